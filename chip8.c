@@ -1,19 +1,30 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <math.h>
 #include <string.h>
 #include <time.h>
 
 #include "SDL2/SDL.h"
+#include "chip8.h"
 
 typedef struct
 {
     SDL_Window *window;
     SDL_Renderer *renderer;
+    SDL_Texture *screen; // DISPLAY_WIDTH x DISPLAY_HEIGHT streaming texture
+    SDL_Texture *grid;   // pixel grid overlay at window resolution
     SDL_AudioSpec want, have;
     SDL_AudioDeviceID  dev;
 } sdl_t;
 
+// screen drawing strategies
+typedef enum
+{
+    RENDERER_RECTS,   // one filled rect per pixel
+    RENDERER_TEXTURE, // framebuffer expanded into a streaming texture, scaled on copy
+} renderer_t;
+
 typedef struct
 {
     uint32_t window_width;
@@ -22,46 +33,111 @@ typedef struct
     uint32_t bg_color;
     uint32_t scale_factor;
     bool pixelated;
-    uint32_t insts_per_second;  //CPUU clock rate
+    uint32_t insts_per_second;  //CPUU clock rate, in cycles with core.cycle_costs
     uint32_t square_wave_freq;
     uint32_t audio_sample_rate;
     int16_t volume;
+    core_config_t core;         // backend and idle skipping, passed through to the core
+    renderer_t renderer;
+    bool software_renderer;     // force SDL's software renderer
+    uint64_t seed;              // CXNN random seed
+    const char *state_file;     // target of the save/load state hotkeys
+    const char *load_state;     // state file to start from, NULL to boot the rom
+    uint32_t rewind_mb;         // rewind buffer memory cap, 0 disables rewinding
+    uint32_t run_ahead;         // frames emulated past the presented one, 0 disables run-ahead
+    const char *record_movie;   // movie file to record the keypad into, or NULL
+    const char *play_movie;     // movie file to take the keypad from, or NULL
+    const char *flamegraph;     // folded call stacks of a PROFILE core go here, or NULL
+    const char *trace_file;     // binary execution trace of a DEBUG core goes here, or NULL
+    bool cpu_stats;             // report host CPU time per wall clock second
+    bool turbo;                 // frames back to back instead of at 60 Hz, toggled with tab
 } config_t;
 
-typedef enum
-{
-    QUIT,
-    RUNNING,
-    PAUSED
-} emu_state_t;
+// longest sleep while paused or waiting for input, bounds how late the
+// CPU use report can be
+#define EVENT_WAIT_MS 250
 
+// one keyframe a second, the frames between are coded against it
+#define REWIND_KEYFRAME_INTERVAL 60
+
+// window title, with the emulated speed appended in turbo
+#define WINDOW_TITLE "CHIP-8 Emulator"
+
+// frame pacing: sleep until this close to a deadline, then spin; a frame
+// over FRAME_RESYNC_MS late starts a new schedule instead of catching up
+#define FRAME_RATE 60
+#define FRAME_SPIN_MS 2
+#define FRAME_LATE_MS 1
+#define FRAME_RESYNC_MS 100
+
+// absolute frame deadlines on the performance counter: frame n is due at
+// origin + n / FRAME_RATE seconds, so rounding never adds up to drift
+typedef struct
+{
+    uint64_t frequency; // performance counter ticks per second
+    uint64_t origin;    // counter value frame 0 of this schedule was due at
+    uint64_t frame;     // frames since origin
+    uint64_t last_wake; // counter value the previous frame woke at, 0 after a resync
+
+    // frame time statistics, in counter ticks; periods are summed as their
+    // error against the nominal period to keep the variance precise
+    uint64_t periods;
+    double error_sum;
+    double error_sum_squares;
+    uint64_t period_min;
+    uint64_t period_max;
+    uint64_t late_max;
+    uint64_t late_frames; // woke over FRAME_LATE_MS past the deadline
+    uint64_t resyncs;     // schedules dropped for falling too far behind
+} frame_scheduler_t;
+
+// a finished frame as the render thread sees it
 typedef struct
 {
-    uint16_t opcode;
-    uint16_t NNN; // 12-bit address
-    uint8_t NN;   // 8-bit address
-    uint8_t N;    // 4-bit address
-    uint8_t X;    // 4-bit register
-    uint8_t Y;    // 4-bit register
-} instruction_t;
+    uint64_t display[DISPLAY_HEIGHT];
+    bool sound;      // sound timer running
+    bool turbo;      // run unthrottled, the title shows the speed
+    uint64_t frames; // frames and instructions run so far, for the speed readout
+    uint64_t insts;
+} frame_t;
+
+// lock-free triple buffer from the emulation thread to the render thread:
+// the writer fills its back slot and swaps it into the shared one, the
+// reader swaps the shared slot for its front one when it holds a newer
+// frame. Neither side ever waits, and frames the reader was too slow for
+// are overwritten
+#define TRIPLE_FRESH 4 // set in shared when it was published since the last read
 
 typedef struct
 {
-    emu_state_t state;
-    uint8_t ram[4096];     // total ram
-    bool display[64 * 32]; // display matrix
-    uint16_t stack[12];     // subroutine/callback stack
-    uint16_t *stack_ptr;   // points to top of stack
-    uint8_t V[16];         // data registers V[0] - V[F]
-    uint16_t I;            // index register
-    uint16_t PC;           // program counter
-    uint8_t delay_timer;
-    uint8_t sound_timer;
-    bool keypad[16];      // hexadecimal keypad 0x0 - 0xF
-    const char *rom_name; // current rom file
-    instruction_t inst;   // current instruction
-    bool draw;            // update the screen; Yes/No
-} chip8_t;
+    frame_t slots[3];
+    uint32_t shared; // slot index in between, only accessed atomically
+    uint32_t back;   // writer's slot
+    uint32_t front;  // reader's slot
+} triple_buffer_t;
+
+// input from the render thread: keypad bits 0-15, INPUT_REWIND while
+// backspace is held, and COMMAND_* bits the emulation thread takes
+#define INPUT_REWIND (1u << 16)
+
+#define COMMAND_QUIT (1u << 0)
+#define COMMAND_PAUSE (1u << 1)
+#define COMMAND_RESET (1u << 2)
+#define COMMAND_SAVE_STATE (1u << 3)
+#define COMMAND_LOAD_STATE (1u << 4)
+#define COMMAND_PROFILE (1u << 5)
+#define COMMAND_TURBO (1u << 6)
+
+// everything the two threads share
+typedef struct
+{
+    uint32_t input;           // atomic
+    uint32_t commands;        // atomic
+    SDL_sem *wake;            // posted on input so a sleeping core reacts at once
+    uint32_t frame_event;     // SDL event pushed when a frame is published
+    uint32_t frame_signalled; // atomic, set until the render thread takes the frame
+    triple_buffer_t frames;
+} shared_t;
 
 // SDL audio callback
 void audio_callback(void *userdata, uint8_t *stream, int len)
@@ -82,6 +158,59 @@ void audio_callback(void *userdata, uint8_t *stream, int len)
     }
 }
 
+// create the streaming screen texture and, if pixelated, the grid overlay
+bool init_screen_textures(sdl_t *sdl, const config_t *config)
+{
+    // nearest neighbour scaling keeps the pixels sharp
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+
+    sdl->screen = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    if (!sdl->screen)
+    {
+        SDL_Log("Could not create screen texture %s\n", SDL_GetError());
+        return false;
+    }
+
+    if (!config->pixelated)
+        return true;
+
+    // outline every cell in the background color, transparent elsewhere; over an
+    // off pixel it is invisible, matching the per-rect outline of the rect renderer
+    const int width = DISPLAY_WIDTH * config->scale_factor;
+    const int height = DISPLAY_HEIGHT * config->scale_factor;
+    uint32_t *pixels = (uint32_t *)calloc((size_t)width * height, sizeof(uint32_t));
+    if (!pixels)
+    {
+        SDL_Log("Could not allocate the pixel grid\n");
+        return false;
+    }
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const uint32_t cell_x = x % config->scale_factor;
+            const uint32_t cell_y = y % config->scale_factor;
+            if (cell_x == 0 || cell_y == 0 || cell_x == config->scale_factor - 1 || cell_y == config->scale_factor - 1)
+                pixels[y * width + x] = config->bg_color;
+        }
+    }
+
+    sdl->grid = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, width, height);
+    if (!sdl->grid)
+    {
+        SDL_Log("Could not create grid texture %s\n", SDL_GetError());
+        free(pixels);
+        return false;
+    }
+
+    SDL_UpdateTexture(sdl->grid, NULL, pixels, width * sizeof(uint32_t));
+    SDL_SetTextureBlendMode(sdl->grid, SDL_BLENDMODE_BLEND);
+    free(pixels);
+
+    return true;
+}
+
 // initialise SDL
 bool init_sdl(sdl_t *sdl, config_t *config)
 {
@@ -92,7 +221,7 @@ bool init_sdl(sdl_t *sdl, config_t *config)
     }
 
     // create window
-    sdl->window = SDL_CreateWindow("CHIP-8 Emulator", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, config->window_width * config->scale_factor, config->window_height * config->scale_factor, 0);
+    sdl->window = SDL_CreateWindow(WINDOW_TITLE, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, config->window_width * config->scale_factor, config->window_height * config->scale_factor, 0);
 
     if (!sdl->window)
     {
@@ -101,7 +230,7 @@ bool init_sdl(sdl_t *sdl, config_t *config)
     }
 
     // create renderer
-    sdl->renderer = SDL_CreateRenderer(sdl->window, -1, SDL_RENDERER_ACCELERATED);
+    sdl->renderer = SDL_CreateRenderer(sdl->window, -1, config->software_renderer ? SDL_RENDERER_SOFTWARE : SDL_RENDERER_ACCELERATED);
 
     if (!sdl->renderer)
     {
@@ -109,6 +238,9 @@ bool init_sdl(sdl_t *sdl, config_t *config)
         return false;
     }
 
+    if (config->renderer == RENDERER_TEXTURE && !init_screen_textures(sdl, config))
+        return false;
+
     // default configuration of sdl->want 
     sdl->want.freq = 44100;
     sdl->want.format = AUDIO_S16LSB;
@@ -150,79 +282,103 @@ bool set_config(config_t *config, int argc, char **argv)
     config->square_wave_freq = 440;
     config->audio_sample_rate = 44100;
     config->volume = 3000;
-
-    return true;
-}
-
-bool init_chip8(chip8_t *chip8, const char *rom_name)
-{
-    const uint32_t entry_point = 0x200;
-    const uint8_t font[] = {
-        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-        0x20, 0x60, 0x20, 0x20, 0x70, // 1
-        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-        0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-    };
-
-    //clear display array
-    memset(chip8, 0, sizeof(chip8_t));
-
-    // load font
-    memcpy(&chip8->ram[0], font, sizeof(font));
-
-    // load rom
-    FILE *rom = fopen(rom_name, "rb");
-    if (!rom)
-    {
-        SDL_Log("Rom file '%s' is invalid or does not exist!\n", rom_name);
-        return false;
-    }
-
-    fseek(rom, 0, SEEK_END);
-    const size_t rom_size = ftell(rom);
-    const size_t max_size = sizeof chip8->ram - entry_point;
-    rewind(rom);
-
-    if (rom_size > max_size)
+    chip8_default_config(&config->core);
+    config->renderer = RENDERER_TEXTURE;
+    config->software_renderer = false;
+    config->seed = (uint64_t)time(NULL);
+    config->load_state = NULL;
+    config->rewind_mb = 16;
+    config->run_ahead = 0;
+    config->record_movie = NULL;
+    config->play_movie = NULL;
+    config->flamegraph = NULL;
+    config->trace_file = NULL;
+    config->cpu_stats = false;
+    config->turbo = false;
+
+    // quick save slot next to the rom
+    static char state_file[1024];
+    snprintf(state_file, sizeof state_file, "%s.state", argc > 1 ? argv[1] : "chip8");
+    config->state_file = state_file;
+
+    // override defaults from the command line
+    for (int i = 2; i < argc; i++)
     {
-        SDL_Log("Rom file '%s' is too big!\nRom size: %zu\nMax size: %zu", rom_name, rom_size, max_size);
-        return false;
+        if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (!chip8_backend_from_name(name, &config->core.backend))
+            {
+                SDL_Log("Unknown backend '%s'\n", name);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--no-idle-skip") == 0)
+            config->core.idle_skip = false;
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc)
+            config->insts_per_second = (uint32_t)strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--cycle-costs") == 0)
+            config->core.cycle_costs = true;
+        else if (strcmp(argv[i], "--renderer") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (strcmp(name, "rects") == 0)
+                config->renderer = RENDERER_RECTS;
+            else if (strcmp(name, "texture") == 0)
+                config->renderer = RENDERER_TEXTURE;
+            else
+            {
+                SDL_Log("Unknown renderer '%s'\n", name);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--software") == 0)
+            config->software_renderer = true;
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            config->seed = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--state-file") == 0 && i + 1 < argc)
+            config->state_file = argv[++i];
+        else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc)
+            config->load_state = argv[++i];
+        else if (strcmp(argv[i], "--rewind-mb") == 0 && i + 1 < argc)
+            config->rewind_mb = (uint32_t)strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc)
+            config->run_ahead = (uint32_t)strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            config->record_movie = argv[++i];
+        else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc)
+            config->play_movie = argv[++i];
+        else if (strcmp(argv[i], "--flamegraph") == 0 && i + 1 < argc)
+            config->flamegraph = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            config->trace_file = argv[++i];
+        else if (strcmp(argv[i], "--cpu-stats") == 0)
+            config->cpu_stats = true;
+        else if (strcmp(argv[i], "--turbo") == 0)
+            config->turbo = true;
+        else
+        {
+            SDL_Log("Unknown option '%s'\n", argv[i]);
+            return false;
+        }
     }
 
-    if (fread(&chip8->ram[entry_point], rom_size, 1, rom) != 1)
+    if (config->record_movie && config->play_movie)
     {
-        SDL_Log("Could not read rom file '%s' into memory!\n", rom_name);
+        SDL_Log("A movie can be recorded or played, not both\n");
         return false;
     }
 
-    fclose(rom);
-
-    chip8->state = RUNNING; // default machine state
-    chip8->PC = entry_point;
-    chip8->rom_name = rom_name;
-    chip8->stack_ptr = &chip8->stack[0];
-    chip8->sound_timer = 0;
-    chip8->delay_timer = 0;
-    chip8->draw = false;
-
     return true;
 }
 
 // cleanup SDL
 void final_cleanup(sdl_t sdl)
 {
+    if (sdl.grid)
+        SDL_DestroyTexture(sdl.grid);
+    if (sdl.screen)
+        SDL_DestroyTexture(sdl.screen);
     SDL_DestroyRenderer(sdl.renderer);
     SDL_DestroyWindow(sdl.window);
     SDL_CloseAudioDevice(sdl.dev);
@@ -242,8 +398,9 @@ void clear_screen(const config_t config, const sdl_t sdl)
     SDL_RenderClear(sdl.renderer);
 }
 
-// update screen with changes
-void update_screen(const sdl_t sdl, const config_t config, const chip8_t chip8)
+// draw the screen as one filled rect per pixel; the back buffer is undefined
+// after a present, so every row is redrawn whenever anything changed
+static void update_screen_rects(const sdl_t sdl, const config_t config, const uint64_t display[DISPLAY_HEIGHT])
 {
     SDL_Rect rect = {.x = 0, .y = 0, .w = (int)config.scale_factor, .h = (int)config.scale_factor};
 
@@ -258,14 +415,16 @@ void update_screen(const sdl_t sdl, const config_t config, const chip8_t chip8)
     uint8_t bg_b = (config.bg_color >> 8) & 0xFF;
     uint8_t bg_a = (config.bg_color >> 0) & 0xFF;
 
-    // loop through the display array and draw a rec per pixel
-    for (uint32_t i = 0; i < sizeof chip8.display; i++)
+    // loop through the display rows and draw a rec per pixel
+    for (uint32_t i = 0; i < DISPLAY_WIDTH * DISPLAY_HEIGHT; i++)
     {
         // convert 1-D index i to 2-D index
-        rect.x = (i % config.window_width) * config.scale_factor;
-        rect.y = (i / config.window_width) * config.scale_factor;
+        const uint32_t x = i % DISPLAY_WIDTH;
+        const uint32_t y = i / DISPLAY_WIDTH;
+        rect.x = x * config.scale_factor;
+        rect.y = y * config.scale_factor;
 
-        if (chip8.display[i]) // pixel is on
+        if ((display[y] >> (63 - x)) & 1) // pixel is on
         {
             SDL_SetRenderDrawColor(sdl.renderer, fg_r, fg_g, fg_b, fg_a);
             SDL_RenderFillRect(sdl.renderer, &rect);
@@ -286,518 +445,611 @@ void update_screen(const sdl_t sdl, const config_t config, const chip8_t chip8)
     SDL_RenderPresent(sdl.renderer);
 }
 
+// expand the dirty rows into the streaming texture and let the renderer scale it
+static void update_screen_texture(const sdl_t sdl, const config_t config, const uint64_t display[DISPLAY_HEIGHT],
+                                  uint32_t dirty_rows)
+{
+    void *pixels;
+    int pitch;
+
+    // upload the span from the first to the last dirty row in one lock
+    uint32_t first = 0, last = DISPLAY_HEIGHT - 1;
+    while (!(dirty_rows & (1u << first)))
+        first++;
+    while (!(dirty_rows & (1u << last)))
+        last--;
+
+    const SDL_Rect span = {0, (int)first, DISPLAY_WIDTH, (int)(last - first + 1)};
+    if (SDL_LockTexture(sdl.screen, &span, &pixels, &pitch) != 0)
+    {
+        SDL_Log("Could not lock screen texture %s\n", SDL_GetError());
+        return;
+    }
+
+    for (uint32_t y = first; y <= last; y++)
+    {
+        uint32_t *row = (uint32_t *)((uint8_t *)pixels + (y - first) * pitch);
+        const uint64_t bits = display[y];
+
+        for (uint32_t x = 0; x < DISPLAY_WIDTH; x++)
+            row[x] = (bits >> (63 - x)) & 1 ? config.fg_color : config.bg_color;
+    }
+
+    SDL_UnlockTexture(sdl.screen);
+
+    SDL_RenderCopy(sdl.renderer, sdl.screen, NULL, NULL);
+    if (sdl.grid)
+        SDL_RenderCopy(sdl.renderer, sdl.grid, NULL, NULL);
+
+    SDL_RenderPresent(sdl.renderer);
+}
+
+// update screen with changes; only call with at least one dirty row
+void update_screen(const sdl_t sdl, const config_t config, const uint64_t display[DISPLAY_HEIGHT], uint32_t dirty_rows)
+{
+    if (config.renderer == RENDERER_TEXTURE)
+        update_screen_texture(sdl, config, display, dirty_rows);
+    else
+        update_screen_rects(sdl, config, display);
+}
+
 // chip8 Keypad     QWERTY keypad
 // 123C             1234
 // 456D             qwer
 // 789E             asdf
 // A0BF             zxcv
 
-// handle user inputs
-void handle_inputs(chip8_t *chip8)
+// post commands for the emulation thread and wake it if it sleeps
+static void send_commands(shared_t *shared, uint32_t commands)
+{
+    __atomic_fetch_or(&shared->commands, commands, __ATOMIC_RELEASE);
+    if (SDL_SemValue(shared->wake) == 0)
+        SDL_SemPost(shared->wake);
+}
+
+// press or release keypad keys or INPUT_REWIND, waking a sleeping core
+static void send_input(shared_t *shared, uint32_t bits, bool down)
+{
+    if (down)
+        __atomic_fetch_or(&shared->input, bits, __ATOMIC_RELEASE);
+    else
+        __atomic_fetch_and(&shared->input, ~bits, __ATOMIC_RELEASE);
+    if (SDL_SemValue(shared->wake) == 0)
+        SDL_SemPost(shared->wake);
+}
+
+// handle user inputs on the render thread: keys go to the core as a bitmask,
+// hotkeys as commands; false once the user quits
+bool handle_inputs(shared_t *shared, bool *exposed)
 {
     SDL_Event event;
 
     while (SDL_PollEvent(&event))
     {
+        uint32_t key = 0;
         switch (event.type)
         {
         case SDL_QUIT:
-            chip8->state = QUIT;
+            return false;
+
+        case SDL_WINDOWEVENT:
+            // window contents were lost, present everything again
+            if (event.window.event == SDL_WINDOWEVENT_EXPOSED)
+                *exposed = true;
             break;
 
         case SDL_KEYDOWN:
             switch (event.key.keysym.sym)
             {
             case SDLK_ESCAPE:
-                chip8->state = QUIT;
-                break;
-
-            case SDLK_SPACE:
-                if (chip8->state == RUNNING)
-                {
-                    chip8->state = PAUSED;
-                    puts("====== PAUSED ======");
-                }
-                else
-                    chip8->state = RUNNING;
-                break;
+                return false;
 
-            case SDLK_EQUALS:   //reset CHIP8 for current rom
-                init_chip8(chip8, chip8->rom_name);
-                break;
+            case SDLK_SPACE:    send_commands(shared, COMMAND_PAUSE); break;
+            case SDLK_TAB:      send_commands(shared, COMMAND_TURBO); break; // turbo, frames as fast as the host runs them
+            case SDLK_EQUALS:   send_commands(shared, COMMAND_RESET); break; //reset CHIP8 for current rom
+            case SDLK_F5:       send_commands(shared, COMMAND_SAVE_STATE); break;
+            case SDLK_F9:       send_commands(shared, COMMAND_LOAD_STATE); break;
+            case SDLK_F3:       send_commands(shared, COMMAND_PROFILE); break; // opcode profile so far
+            case SDLK_BACKSPACE: key = INPUT_REWIND; break;
 
             // Map chip8 keypad
-            case SDLK_1: chip8->keypad[0x1] = true; break;
-            case SDLK_2: chip8->keypad[0x2] = true; break;
-            case SDLK_3: chip8->keypad[0x3] = true; break;
-            case SDLK_4: chip8->keypad[0xC] = true; break;
-
-            case SDLK_q: chip8->keypad[0x4] = true; break;
-            case SDLK_w: chip8->keypad[0x5] = true; break;
-            case SDLK_e: chip8->keypad[0x6] = true; break;
-            case SDLK_r: chip8->keypad[0xD] = true; break;
-
-            case SDLK_a: chip8->keypad[0x7] = true; break;
-            case SDLK_s: chip8->keypad[0x8] = true; break;
-            case SDLK_d: chip8->keypad[0x9] = true; break;
-            case SDLK_f: chip8->keypad[0xE] = true; break;
-
-            case SDLK_z: chip8->keypad[0xA] = true; break;
-            case SDLK_x: chip8->keypad[0x0] = true; break;
-            case SDLK_c: chip8->keypad[0xB] = true; break;
-            case SDLK_v: chip8->keypad[0xF] = true; break;
+            case SDLK_1: key = 1u << 0x1; break;
+            case SDLK_2: key = 1u << 0x2; break;
+            case SDLK_3: key = 1u << 0x3; break;
+            case SDLK_4: key = 1u << 0xC; break;
+
+            case SDLK_q: key = 1u << 0x4; break;
+            case SDLK_w: key = 1u << 0x5; break;
+            case SDLK_e: key = 1u << 0x6; break;
+            case SDLK_r: key = 1u << 0xD; break;
+
+            case SDLK_a: key = 1u << 0x7; break;
+            case SDLK_s: key = 1u << 0x8; break;
+            case SDLK_d: key = 1u << 0x9; break;
+            case SDLK_f: key = 1u << 0xE; break;
+
+            case SDLK_z: key = 1u << 0xA; break;
+            case SDLK_x: key = 1u << 0x0; break;
+            case SDLK_c: key = 1u << 0xB; break;
+            case SDLK_v: key = 1u << 0xF; break;
 
             default:
                 break;
             }
 
+            if (key && !event.key.repeat)
+                send_input(shared, key, true);
             break;
 
         case SDL_KEYUP:
             switch (event.key.keysym.sym)
             {
+            case SDLK_BACKSPACE: key = INPUT_REWIND; break;
 
             // Map chip8 keypad
-            case SDLK_1: chip8->keypad[0x1] = false; break;
-            case SDLK_2: chip8->keypad[0x2] = false; break;
-            case SDLK_3: chip8->keypad[0x3] = false; break;
-            case SDLK_4: chip8->keypad[0xC] = false; break;
-
-            case SDLK_q: chip8->keypad[0x4] = false; break;
-            case SDLK_w: chip8->keypad[0x5] = false; break;
-            case SDLK_e: chip8->keypad[0x6] = false; break;
-            case SDLK_r: chip8->keypad[0xD] = false; break;
-
-            case SDLK_a: chip8->keypad[0x7] = false; break;
-            case SDLK_s: chip8->keypad[0x8] = false; break;
-            case SDLK_d: chip8->keypad[0x9] = false; break;
-            case SDLK_f: chip8->keypad[0xE] = false; break;
-
-            case SDLK_z: chip8->keypad[0xA] = false; break;
-            case SDLK_x: chip8->keypad[0x0] = false; break;
-            case SDLK_c: chip8->keypad[0xB] = false; break;
-            case SDLK_v: chip8->keypad[0xF] = false; break;
-                
+            case SDLK_1: key = 1u << 0x1; break;
+            case SDLK_2: key = 1u << 0x2; break;
+            case SDLK_3: key = 1u << 0x3; break;
+            case SDLK_4: key = 1u << 0xC; break;
+
+            case SDLK_q: key = 1u << 0x4; break;
+            case SDLK_w: key = 1u << 0x5; break;
+            case SDLK_e: key = 1u << 0x6; break;
+            case SDLK_r: key = 1u << 0xD; break;
+
+            case SDLK_a: key = 1u << 0x7; break;
+            case SDLK_s: key = 1u << 0x8; break;
+            case SDLK_d: key = 1u << 0x9; break;
+            case SDLK_f: key = 1u << 0xE; break;
+
+            case SDLK_z: key = 1u << 0xA; break;
+            case SDLK_x: key = 1u << 0x0; break;
+            case SDLK_c: key = 1u << 0xB; break;
+            case SDLK_v: key = 1u << 0xF; break;
+
             default:
                 break;
             }
 
+            if (key)
+                send_input(shared, key, false);
             break;
 
         default:
             break;
         }
     }
+    return true;
+}
+
+static void init_scheduler(frame_scheduler_t *scheduler)
+{
+    memset(scheduler, 0, sizeof *scheduler);
+    scheduler->frequency = SDL_GetPerformanceFrequency();
+    scheduler->origin = SDL_GetPerformanceCounter();
+    scheduler->period_min = UINT64_MAX;
 }
 
-#ifdef DEBUG
-void print_debug_info(chip8_t *chip8)
+// start a new schedule from now, after a pause or a stall
+static void resync_scheduler(frame_scheduler_t *scheduler)
 {
-    printf("Address: 0x%04X, Opcode: 0x%04X, Desc: ", chip8->PC - 2, chip8->inst.opcode);
-    switch ((chip8->inst.opcode >> 12) & 0x0F)
+    scheduler->origin = SDL_GetPerformanceCounter();
+    scheduler->frame = 0;
+    scheduler->last_wake = 0;
+}
+
+// block until the next frame is due: SDL_Delay only has whole millisecond
+// resolution and can oversleep, so it is stopped short and the rest spun
+static void wait_next_frame(frame_scheduler_t *scheduler)
+{
+    const uint64_t frequency = scheduler->frequency;
+    scheduler->frame++;
+    const uint64_t deadline = scheduler->origin + scheduler->frame / FRAME_RATE * frequency +
+                              scheduler->frame % FRAME_RATE * frequency / FRAME_RATE;
+
+    uint64_t now = SDL_GetPerformanceCounter();
+    if (now > deadline + FRAME_RESYNC_MS * frequency / 1000)
     {
-    case 0x00:
-        if (chip8->inst.NN == 0xE0) 
-            printf("Clear screen\n");
-        else if (chip8->inst.NN == 0xEE) 
-            printf("Return from subroutine to address 0x%04X\n", *(chip8->stack_ptr - 1));
-        else
-            printf("Unimplemented opcode\n");
-        break;
+        scheduler->resyncs++;
+        resync_scheduler(scheduler);
+        return;
+    }
 
-    case 0x01:
-        printf("Jump to NNN (0x%03X)\n", chip8->inst.NNN);
-        break;
+    if (now < deadline)
+    {
+        const uint64_t sleep_ms = (deadline - now) * 1000 / frequency;
+        if (sleep_ms > FRAME_SPIN_MS)
+            SDL_Delay((Uint32)(sleep_ms - FRAME_SPIN_MS));
+        while ((now = SDL_GetPerformanceCounter()) < deadline)
+            ;
+    }
 
-    case 0x02:
-        printf("Call subroutine at NNN (0x%03X)\n", chip8->inst.NNN);
-        break;
+    const uint64_t late = now - deadline;
+    if (late > scheduler->late_max)
+        scheduler->late_max = late;
+    if (late > FRAME_LATE_MS * frequency / 1000)
+        scheduler->late_frames++;
 
-    case 0x03:
-        printf("Skip next instruction if V[%X] (0x%02X) == NN (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-        break;
+    if (scheduler->last_wake)
+    {
+        const uint64_t period = now - scheduler->last_wake;
+        const double error = (double)period - (double)frequency / FRAME_RATE;
+        scheduler->periods++;
+        scheduler->error_sum += error;
+        scheduler->error_sum_squares += error * error;
+        if (period < scheduler->period_min)
+            scheduler->period_min = period;
+        if (period > scheduler->period_max)
+            scheduler->period_max = period;
+    }
+    scheduler->last_wake = now;
+}
 
-    case 0x04:
-        printf("Skip next instruction if V[%X] (0x%02X) != NN (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-        break;
+static void print_scheduler_stats(const frame_scheduler_t *scheduler)
+{
+    if (scheduler->periods == 0)
+        return;
+
+    const double ms = 1000.0 / scheduler->frequency;
+    const double mean_error = scheduler->error_sum / scheduler->periods;
+    const double mean = (double)scheduler->frequency / FRAME_RATE + mean_error;
+    const double variance = scheduler->error_sum_squares / scheduler->periods - mean_error * mean_error;
+    printf("frame pacing: %llu frames at %.3f Hz, period %.3f ms, jitter %.3f ms (stddev), %.3f to %.3f ms\n",
+           (unsigned long long)scheduler->periods, scheduler->frequency / mean, mean * ms,
+           variance > 0 ? sqrt(variance) * ms : 0.0, scheduler->period_min * ms, scheduler->period_max * ms);
+    printf("frame pacing: %llu frames over %d ms late, at most %.3f ms, %llu resyncs\n",
+           (unsigned long long)scheduler->late_frames, FRAME_LATE_MS, scheduler->late_max * ms,
+           (unsigned long long)scheduler->resyncs);
+}
 
-    case 0x05:
-        printf("Skip next instruction if V[%X] (0x%02X) = V[%X] (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
-        break;
+// hidden frames for run-ahead: the timers tick and the core runs as in the
+// main loop, but nothing is drawn and the audio device is left alone; the
+// clock is a copy, the real frames still run it. The profile and trace are
+// detached meanwhile, they only see instructions that are not rolled back
+static void run_hidden_frames(chip8_t *chip8, const config_t *config, uint32_t frames, chip8_frame_clock_t clock)
+{
+    chip8_profile_t *profile = chip8->profile;
+    chip8_trace_t *trace = chip8->trace;
+    chip8->profile = NULL;
+    chip8->trace = NULL;
 
-    case 0x06:
-        printf("Set V[%X] to NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
-        break;
+    for (uint32_t frame = 0; frame < frames; frame++)
+    {
+        chip8_tick_timers(chip8);
+        chip8_run_frame(chip8, &config->core, &clock);
+    }
 
-    case 0x07:
-        printf("Add NN (0x%02X) to V[%X]\n", chip8->inst.NN, chip8->inst.X);
-        break;
+    chip8->profile = profile;
+    chip8->trace = trace;
+}
 
-    case 0x08:
-        switch (chip8->inst.N)
+// rows that differ from the last presented display, which is brought up to date
+static uint32_t changed_rows(const uint64_t display[DISPLAY_HEIGHT], uint64_t presented[DISPLAY_HEIGHT])
+{
+    uint32_t rows = 0;
+    for (uint32_t row = 0; row < DISPLAY_HEIGHT; row++)
+    {
+        if (display[row] != presented[row])
         {
-        case 0x0:
-            printf("set V[%X] = V[%X] (0x%02X)\n", chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y]);
-            break;
-        case 0x1:
-            printf("set V[%X] (0x%02X) |= V[%X] (0x%02X) Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->V[chip8->inst.X] | chip8->V[chip8->inst.Y]);
-            break;
-        case 0x2:
-            printf("set V[%X] (0x%02X) &= V[%X] (0x%02X) Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->V[chip8->inst.X] & chip8->V[chip8->inst.Y]);
-            break;
-        case 0x3:
-            printf("set V[%X] (0x%02X) ^= V[%X] (0x%02X) Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->V[chip8->inst.X] ^ chip8->V[chip8->inst.Y]);
-            break;
-        case 0x4: // set V[F] to 1 if carry
-            printf("set V[%X] (0x%02X) += V[%X] (0x%02X) Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]);
-            break;
-        case 0x5: // set V[F] to 1 if no borrow
-            printf("set V[%X] (0x%02X) -= V[%X] (0x%02X) Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->V[chip8->inst.X] - chip8->V[chip8->inst.Y]);
-            break;
-        case 0x6: // stores the LSB of V[X] in V[F]
-            printf("set V[%X] (0x%02X) >>= 1 Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] >> 1);
-            break;
-        case 0x7: // set V[X] = V[Y] - V[X]
-            printf("set V[%X] (0x%02X) = V[%X] (0x%02X) - V[%X] Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->inst.X, chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X]);
-            break;
-        case 0xE: // stores the MSB of V[X] in V[F]
-            printf("set V[%X] (0x%02X) <<= 1 Result: 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] << 1);
-            break;
-        default:
-            break;
+            rows |= 1u << row;
+            presented[row] = display[row];
         }
+    }
+    return rows;
+}
 
-        break;
-
-    case 0x09:
-        printf("Skip next instruction if V[%X] (0x%02X) != V[%X] (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
-        break;
+// writer side: fill the back slot, then make it the newest frame
+static frame_t *triple_back(triple_buffer_t *frames)
+{
+    return &frames->slots[frames->back];
+}
 
-    case 0x0A:
-        printf("Set I to NNN (0x%03X)\n", chip8->inst.NNN);
-        break;
+static void triple_publish(triple_buffer_t *frames)
+{
+    frames->back = __atomic_exchange_n(&frames->shared, frames->back | TRIPLE_FRESH, __ATOMIC_ACQ_REL) & 3;
+}
 
-    case 0x0B:
-        printf("Set PC to V[0] (0x%02X) + NNN (0x%03X) Result: %04X\n", chip8->V[0x0], chip8->inst.NNN, chip8->V[0x0] + chip8->inst.NNN);
-        break;
+// reader side: the newest frame, or the one read last if none came since
+static const frame_t *triple_take(triple_buffer_t *frames)
+{
+    if (__atomic_load_n(&frames->shared, __ATOMIC_ACQUIRE) & TRIPLE_FRESH)
+        frames->front = __atomic_exchange_n(&frames->shared, frames->front, __ATOMIC_ACQ_REL) & 3;
+    return &frames->slots[frames->front];
+}
 
-    case 0xC:
-        printf("Set V[%X] to rand(0-255) & NN (%02X) Result: %02X\n", chip8->inst.X, chip8->inst.NN, (rand() % 256) & chip8->inst.NN);
-        break;
+// the emulation thread: it owns the instance, the rewind buffer, the movie
+// and the frame clock; main reads the statistics after joining it
+typedef struct
+{
+    const config_t *config; // read only once the thread runs
+    shared_t *shared;
+    chip8_t *chip8;
+    chip8_rewind_t *rewind;
+    chip8_movie_t movie;
+    chip8_movie_position_t movie_position;
+    bool playing;
+    bool turbo;             // starts from config->turbo, toggled with tab
+    uint64_t publish_ticks; // shortest time between frames published in turbo
+
+    frame_scheduler_t scheduler;
+    uint64_t insts_requested;
+    uint64_t frames_run;
+    uint64_t frames_published;
+    uint64_t run_ahead_ns;
+    uint64_t run_ahead_count;
+    uint64_t turbo_frames, turbo_insts, turbo_ticks;
+} emulator_t;
+
+// hand the display to the render thread, waking it if it took the last one;
+// sound comes from the real frame, the display may be a run-ahead one
+static void publish_frame(emulator_t *emulator, bool sound)
+{
+    shared_t *shared = emulator->shared;
+    const chip8_t *chip8 = emulator->chip8;
+
+    frame_t *frame = triple_back(&shared->frames);
+    memcpy(frame->display, chip8->display, sizeof frame->display);
+    frame->sound = sound;
+    frame->turbo = emulator->turbo;
+    frame->frames = emulator->frames_run;
+    frame->insts = emulator->insts_requested;
+    triple_publish(&shared->frames);
+    emulator->frames_published++;
+
+    if (__atomic_exchange_n(&shared->frame_signalled, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        SDL_Event event;
+        memset(&event, 0, sizeof event);
+        event.type = shared->frame_event;
+        SDL_PushEvent(&event);
+    }
+}
 
-    case 0x0D:
-        printf("Draw %X height sprite at at coords (V[%X], V[%X])\n", chip8->inst.N, chip8->inst.X, chip8->inst.Y);
-        break;
+// act on the hotkeys the render thread sent since the last frame
+static void run_commands(emulator_t *emulator)
+{
+    const uint32_t commands = __atomic_exchange_n(&emulator->shared->commands, 0, __ATOMIC_ACQUIRE);
+    const config_t *config = emulator->config;
+    chip8_t *chip8 = emulator->chip8;
+    if (!commands)
+        return;
 
-    case 0x0E:
-        if(chip8->inst.NN == 0x9E){
-            printf("Skip next instruction if key stored in V[%X] is pressed; Keypad Value: %d\n", chip8->inst.X, chip8->keypad[chip8->V[chip8->inst.X]]);
-        }
-        else if(chip8->inst.NN == 0xA1){
-            printf("Skip next instruction if key stored in V[%X] is NOT pressed; Keypad Value: %d\n", chip8->inst.X, chip8->keypad[chip8->V[chip8->inst.X]]);
-        }
-        break;
+    if (commands & COMMAND_QUIT)
+    {
+        chip8->state = QUIT;
+        return;
+    }
 
-    case 0x0F:
-        switch(chip8->inst.NN)
+    if (commands & COMMAND_PAUSE)
+    {
+        if (chip8->state == RUNNING)
         {
-            case 0x0A:
-                printf("Set V[%X] to the key pressed; Await a key press\n", chip8->inst.X);
-                break;
-            case 0x1E:
-                printf("Set I (0x%04X) += V[%X] (0x%02X) Result: 0x%04X\n", chip8->I, chip8->inst.X, chip8->V[chip8->inst.X], chip8->I + chip8->V[chip8->inst.X]);
-                break;
-            case 0x07:
-                printf("Set V[%X] = delay timer (0x%02X)\n", chip8->inst.X, chip8->delay_timer);
-                break;
-            case 0x15:
-                printf("set delay timer = V[%X] (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
-                break;
-            case 0x18:
-                printf("set sound timer = V[%X] (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
-                break;
-            case 0x29: 
-                printf("Set I = location of sprite of character stored in V[%X] (0x%02X); Result(V[%X] * 5): 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.X, chip8->V[chip8->inst.X] * 5);
-                break;
-            case 0x33:
-                printf("Store BCD representation of V[%X] (0x%02X) in memory from index I (0x%04X) onwards\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
-                break;
-            case 0x55:
-                printf("Store values of registers V[0] - V[%X] in memory from index I (0x%04X) onwards\n", chip8->inst.X, chip8->I);
-                break;
-            case 0x65:
-                printf("Load values of registers V[0] - V[%X] in memory from index I (0x%04X) onwards\n", chip8->inst.X, chip8->I);
-                break;
-            default:
-                break;
+            chip8->state = PAUSED;
+            puts("====== PAUSED ======");
         }
-        break;
+        else
+            chip8->state = RUNNING;
+    }
 
-    default:
-        printf("Unimplemented opcode\n");
-        break; // unimplemented or invalid opcode
+    if (commands & COMMAND_TURBO)
+    {
+        emulator->turbo = !emulator->turbo;
+        if (emulator->turbo)
+            puts("====== TURBO ======");
     }
-}
-#endif
 
-// emulates instructions for chip8
-void emulate_instructions(chip8_t *chip8, const config_t config)
-{
-    // get the next 16-bit opcode from ram
-    chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | (chip8->ram[chip8->PC + 1]);
-    chip8->PC += 2;
+    if (commands & COMMAND_RESET)
+    {
+        if (config->record_movie || config->play_movie)
+            puts("Reset is disabled while a movie is recorded or played");
+        else
+            chip8_load_rom_file(chip8, chip8->rom_name);
+    }
 
-    // fill out registers and constants for the opcode
-    chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;
-    chip8->inst.NN = chip8->inst.opcode & 0x00FF;
-    chip8->inst.N = chip8->inst.opcode & 0x000F;
-    chip8->inst.X = (chip8->inst.opcode & 0x0F00) >> 8;
-    chip8->inst.Y = (chip8->inst.opcode & 0x00F0) >> 4;
+    if ((commands & COMMAND_SAVE_STATE) && chip8_save_state_file(chip8, config->state_file))
+        printf("State saved to '%s'\n", config->state_file);
 
-#ifdef DEBUG
-    print_debug_info(chip8);
-#endif
+    if (commands & COMMAND_LOAD_STATE)
+    {
+        if (config->record_movie || config->play_movie)
+            puts("Loading a state is disabled while a movie is recorded or played");
+        else if (chip8_load_state_file(chip8, config->state_file))
+            printf("State loaded from '%s'\n", config->state_file);
+    }
 
-    // emulate opcode
-    switch ((chip8->inst.opcode >> 12) & 0xF)
+    if (commands & COMMAND_PROFILE)
     {
-    case 0x0:
-        if (chip8->inst.NN == 0xE0){ // clear screen
-            memset(&chip8->display[0], false, sizeof chip8->display);
-            chip8->draw = true;
-        }
-        else if (chip8->inst.NN == 0xEE) // return from subroutine
-            chip8->PC = *--chip8->stack_ptr;
-        break;
-
-    case 0x1: // jump to address NNN
-        chip8->PC = chip8->inst.NNN;
-        break;
-
-    case 0x2: // call subroutine at NNN
-        *chip8->stack_ptr++ = chip8->PC;
-        chip8->PC = chip8->inst.NNN;
-        break;
-
-    case 0x3: // skip the next instruction if V[X] = NN
-        if (chip8->V[chip8->inst.X] == chip8->inst.NN)
-            chip8->PC += 2;
-        break;
-
-    case 0x4: // skip the next instruction if V[X] = NN
-        if (chip8->V[chip8->inst.X] != chip8->inst.NN)
-            chip8->PC += 2;
-        break;
-
-    case 0x5: // skip next instruction if V[X] = V[Y] (5XY0)
-        if ((chip8->inst.N == 0) && (chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]))
-            chip8->PC += 2;
-        break;
-
-    case 0x6: // set V[X] to NN
-        chip8->V[chip8->inst.X] = chip8->inst.NN;
-        break;
-
-    case 0x7: // add NN to V[X] (carry flag is not changed)
-        chip8->V[chip8->inst.X] += chip8->inst.NN;
-        break;
-
-    case 0x8:
-        switch (chip8->inst.N)
-        {
-        case 0x0: // set V[X] = V[Y]
-            chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
-            break;
-        case 0x1: // set V[X] |= V[Y]
-            chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
-            break;
-        case 0x2: // set V[X] &= V[Y]
-            chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
-            break;
-        case 0x3: // set V[X] ^= V[Y]
-            chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
-            break;
-        case 0x4: // set V[X] += V[Y], set V[F] to 1 if carry
-            chip8->V[0xF] =  ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255);
-            chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
-            break;
-        case 0x5: // set V[X] -= V[Y], set V[F] to 1 if no borrow
-            chip8->V[0xF] = (chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y]);
-            chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
-            break;
-        case 0x6: // stores the LSB of V[X] in V[F] and sets V[X] >>= 1
-            chip8->V[0xF] = chip8->V[chip8->inst.X] & 0x01;
-            chip8->V[chip8->inst.X] >>= 1;
-            break;
-        case 0x7: // set V[X] = V[Y] - V[X]
-            chip8->V[0xF] = chip8->V[chip8->inst.Y] >= chip8->V[chip8->inst.X];
+        if (!chip8_profile_report(chip8))
+            puts("Opcode profiling needs a core built with PROFILE (make profile)");
+        else if (config->flamegraph && chip8_profile_write_folded(chip8, config->flamegraph))
+            printf("Call stacks written to '%s'\n", config->flamegraph);
+    }
+}
 
-            chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
-            break;
-        case 0xE: // stores the MSB of V[X] in V[F] and sets V[X] <<= 1
-            chip8->V[0xF] = (chip8->V[chip8->inst.X] & 0x80) >> 7;
-            chip8->V[chip8->inst.X] <<= 1;
-            break;
-        default:
+// emulation thread: frames on its own clock, whatever the renderer is doing
+static int run_emulator(void *data)
+{
+    emulator_t *emulator = (emulator_t *)data;
+    const config_t *config = emulator->config;
+    shared_t *shared = emulator->shared;
+    chip8_t *chip8 = emulator->chip8;
+    chip8_rewind_t *rewind = emulator->rewind;
+    chip8_movie_t *movie = &emulator->movie;
+
+    // run-ahead rolls back to this state after publishing a future frame
+    static chip8_state_t run_ahead_state;
+
+    chip8_frame_clock_t clock;
+    chip8_frame_clock_start(&clock, chip8, config->insts_per_second);
+    uint64_t frame_insts = 0;
+    uint64_t cpu_report_wall = chip8_time_ns();
+    uint64_t cpu_report = chip8_cpu_time_ns();
+    bool was_turbo = false;
+    uint64_t turbo_start_time = 0, turbo_start_frames = 0, turbo_start_insts = 0;
+    uint64_t next_publish = 0;
+    init_scheduler(&emulator->scheduler);
+
+    while (chip8->state != QUIT)
+    {
+        run_commands(emulator);
+        if (chip8->state == QUIT)
             break;
-        }
-        break;
 
-    case 0x9: // skip next instruction if V[X] != V[Y] (9XY0)
-        if ((chip8->inst.N == 0) && (chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y]))
-            chip8->PC += 2;
-        break;
+        const uint32_t input = __atomic_load_n(&shared->input, __ATOMIC_ACQUIRE);
+        const bool rewinding = rewind && (input & INPUT_REWIND);
+        const bool turbo = emulator->turbo && !rewinding;
 
-    case 0xA: // set index reg to NNN
-        chip8->I = chip8->inst.NNN;
-        break;
-
-    case 0xB: // set PC to V[0] + NNN
-        chip8->PC = chip8->V[0x0] + chip8->inst.NNN;
-        break;
+        // back to 60 Hz from where turbo left the machine, or speed it up
+        if (emulator->turbo != was_turbo)
+        {
+            const uint64_t now = SDL_GetPerformanceCounter();
+            if (emulator->turbo)
+            {
+                turbo_start_time = now;
+                turbo_start_frames = emulator->frames_run;
+                turbo_start_insts = emulator->insts_requested;
+            }
+            else
+            {
+                emulator->turbo_ticks += now - turbo_start_time;
+                emulator->turbo_frames += emulator->frames_run - turbo_start_frames;
+                emulator->turbo_insts += emulator->insts_requested - turbo_start_insts;
+                resync_scheduler(&emulator->scheduler);
+            }
+            was_turbo = emulator->turbo;
+        }
 
-    case 0xC: // set V[X] = rand(0-255) & NN
-        chip8->V[chip8->inst.X] = (rand() % 256) & chip8->inst.NN;
-        break;
+        // keys held now, unless a movie is playing them
+        if (!emulator->playing)
+            chip8_set_keys(chip8, (uint16_t)input);
 
-    case 0xD: // draw N height sprites (stored at location I) at coords (V[X], V[Y])
-    {
-        uint8_t x_coord = chip8->V[chip8->inst.X] % config.window_width;
-        uint8_t y_coord = chip8->V[chip8->inst.Y] % config.window_height;
-        const uint8_t org_X = x_coord;
+        // paused, or stuck in a loop only a key can end: nothing will change
+        // until the next input, so sleep until it arrives instead of spinning
+        const bool sleeping = chip8->state == PAUSED ||
+                              (!rewinding && !emulator->playing && config->core.idle_skip && chip8_waiting_for_input(chip8));
 
-        chip8->V[0xF] = 0; // set carry flags to 0
+        if (config->cpu_stats && chip8_time_ns() - cpu_report_wall >= 1000000000ull)
+        {
+            const uint64_t wall = chip8_time_ns();
+            const uint64_t cpu = chip8_cpu_time_ns();
+            printf("cpu: %.1f ms per second (%s)\n", (cpu - cpu_report) / 1e6 / ((wall - cpu_report_wall) / 1e9),
+                   chip8->state == PAUSED ? "paused" : sleeping ? "waiting for input" : "running");
+            cpu_report_wall = wall;
+            cpu_report = cpu;
+        }
 
-        for (uint8_t i = 0; i < chip8->inst.N; i++) // traverse all rows of the sprite
+        if (sleeping)
         {
-            // get next byte/data of the sprite
-            const uint8_t sprite_data = chip8->ram[chip8->I + i];
-            x_coord = org_X;
+            publish_frame(emulator, chip8->sound_timer > 0);
+            SDL_SemWaitTimeout(shared->wake, EVENT_WAIT_MS);
+            resync_scheduler(&emulator->scheduler);
+            continue;
+        }
 
-            // traverse the 8-bit sprite data left to right
-            for (uint8_t j = 0; j < 8; j++)
+        // emulate chip8 instructions for this frame (60hz), or go back one
+        // recorded frame while rewinding
+        if (rewinding)
+        {
+            // the keys held now win over the ones recorded back then
+            chip8_rewind_pop(rewind, chip8);
+            chip8_set_keys(chip8, (uint16_t)input);
+        }
+        else
+        {
+            // movie input replaces the keyboard until the movie is over
+            if (emulator->playing)
             {
-                bool *pixel = &chip8->display[y_coord * config.window_width + x_coord];
-                //const bool sprite_bit = sprite_data & (1 << j);
-                const bool sprite_bit = (sprite_data & (0x80 >> j)) != 0; 
-
-                if (sprite_bit && *pixel)
-                    chip8->V[0xF] = 1;
-
-                *pixel ^= sprite_bit;
-
-                if (++x_coord >= config.window_width)
-                    break;
+                emulator->playing = chip8_movie_play_keys(movie, &emulator->movie_position, chip8);
+                if (!emulator->playing)
+                    printf("Movie over after %llu of %llu frames, framebuffers %s the recording\n",
+                           (unsigned long long)emulator->movie_position.frames, (unsigned long long)movie->end.frames,
+                           emulator->movie_position.display_hash == movie->end.display_hash ? "match" : "differ from");
             }
+            else if (config->record_movie)
+                chip8_movie_record_keys(movie, chip8);
 
-            if (++y_coord >= config.window_height)
-                break;
+            // run to the next cycle deadline, the fractions carried across frames
+            frame_insts = chip8_run_frame(chip8, &config->core, &clock);
+            emulator->insts_requested += frame_insts;
+            emulator->frames_run++;
         }
-        chip8->draw = true;
-        break;
-    }
 
-    case 0xE:
-        if(chip8->inst.NN == 0x9E){ // skip next instruction if key stored in V[X] is pressed
-            if(chip8->keypad[chip8->V[chip8->inst.X]] == true)
-                chip8->PC += 2;
+        // hold 60 fps against absolute deadlines, whatever this frame cost;
+        // turbo publishes at most once per display refresh
+        bool publish = true;
+        if (!turbo)
+            wait_next_frame(&emulator->scheduler);
+        else
+        {
+            const uint64_t now = SDL_GetPerformanceCounter();
+            publish = now >= next_publish;
+            if (publish)
+                next_publish = now + emulator->publish_ticks;
         }
-        else if(chip8->inst.NN == 0xA1){ // skip next instruction if key stored in V[X] is NOT pressed
-            if(chip8->keypad[chip8->V[chip8->inst.X]] == false)
-                chip8->PC += 2;
+
+        // publish the frame run_ahead frames from now, as if the input read
+        // above had arrived that much earlier; the beeper follows the real
+        // timer, sampled before the hidden frames move it
+        const bool sound = chip8->sound_timer > 0;
+        const uint64_t idle_skipped = chip8->idle_skipped;
+        const uint64_t cycles = chip8->cycles;
+        const bool run_ahead = config->run_ahead > 0 && !rewinding && !turbo;
+        if (run_ahead)
+        {
+            const uint64_t ahead_start = chip8_time_ns();
+            chip8_snapshot(chip8, &run_ahead_state);
+            run_hidden_frames(chip8, config, config->run_ahead, clock);
+            emulator->run_ahead_ns += chip8_time_ns() - ahead_start;
+            emulator->run_ahead_count++;
         }
-        break;
 
-    case 0xF:
-        switch(chip8->inst.NN)
+        if (publish)
+            publish_frame(emulator, sound);
+
+        // back to the real frame
+        if (run_ahead)
         {
-            case 0x0A: // V[X] = get_key(); Await a key press
-            {    
-                bool key_pressed = false;
-                for(uint8_t i = 0; i < sizeof chip8->keypad; i++)
-                {
-                    if(chip8->keypad[i]){
-                        chip8->V[chip8->inst.X] = i;
-                        key_pressed = true;
-                        break;
-                    }
-                }
-                if(!key_pressed)
-                    chip8->PC -= 2; // stay here until a key is pressed
-                break;
-            }
-            case 0x1E: // set I += V[X]; V[F] is not affected
-                chip8->I += chip8->V[chip8->inst.X];
-                break;
-            case 0x07: // set V[X] = delay timer
-                chip8->V[chip8->inst.X] = chip8->delay_timer;
-                break;
-            case 0x15: // set delay timer = V[X]
-                chip8->delay_timer = chip8->V[chip8->inst.X];
-                break;
-            case 0x18: // set sound timer = V[X]
-                chip8->sound_timer = chip8->V[chip8->inst.X];
-                break;
-            case 0x29: // set I to the location of sprite of character stored in V[X]
-                chip8->I = chip8->V[chip8->inst.X] * 5;
-                break;
-            case 0x33: // store BCD rep pf V[X] from index I onwards(I -> hundred's, I+1 -> ten's, I+2 -> one's)
-            {   
-                uint8_t bcd = chip8->V[chip8->inst.X];
-                for(int i = 2; i >= 0; i--){
-                    chip8->ram[chip8->I+i] = bcd % 10;
-                    bcd /= 10;
-                }
-                break;
-            }
-            case 0x55: // store values from V[0] to V[X] in memory from index I onwards
-            {
-                for(uint8_t i = 0; i <= chip8->inst.X; i++)
-                {
-                    chip8->ram[chip8->I + i] = chip8->V[i];
-                }
-                break;
-            }
-            case 0x65: // store values from V[0] to V[X] in memory from index I onwards
-            {
-                for(uint8_t i = 0; i <= chip8->inst.X; i++)
-                {
-                    chip8->V[i] = chip8->ram[chip8->I + i];
-                }
-                break;
-            }
-            default:
-                break;
+            const uint64_t ahead_start = chip8_time_ns();
+            chip8_restore(chip8, &run_ahead_state);
+            chip8->idle_skipped = idle_skipped;
+            chip8->cycles = cycles;
+            emulator->run_ahead_ns += chip8_time_ns() - ahead_start;
         }
-        break;
 
-    default:
-        break; // unimplemented or invalid opcode
-    }
-}
+        // timers tick once per emulated frame
+        if (!rewinding)
+            chip8_tick_timers(chip8);
 
-// update delay and sound timers
-void update_timers(const sdl_t sdl, chip8_t *chip8)
-{
-    if(chip8->delay_timer > 0)
-        chip8->delay_timer--;
+        // record the frame boundary for rewinding; in turbo only the frames
+        // that are published, the rest would evict minutes of history a second
+        if (rewind && !rewinding && publish)
+            chip8_rewind_push(rewind, chip8);
 
-    if(chip8->sound_timer > 0)
-    {
-        chip8->sound_timer--;
-        SDL_PauseAudioDevice(sdl.dev, 0); // play sound
+        // fold the finished frame into the movie hash
+        if (emulator->playing)
+            chip8_movie_end_frame(&emulator->movie_position, chip8, frame_insts);
+        else if (config->record_movie)
+            chip8_movie_end_frame(&movie->end, chip8, frame_insts);
     }
-    else
+
+    if (was_turbo)
     {
-        SDL_PauseAudioDevice(sdl.dev, 1); // stop playing sound
+        emulator->turbo_ticks += SDL_GetPerformanceCounter() - turbo_start_time;
+        emulator->turbo_frames += emulator->frames_run - turbo_start_frames;
+        emulator->turbo_insts += emulator->insts_requested - turbo_start_insts;
     }
+    return 0;
 }
 
 int main(int argc, char **argv)
 {
     if (argc < 2)
     {
-        fprintf(stderr, "Usage: %s <rom_name>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <rom_name> [--backend switch|table|cached|jit|aot] [--no-idle-skip]\n"
+                        "       [--ips N] [--cycle-costs] [--renderer rects|texture] [--software] [--seed N]\n"
+                        "       [--state-file file] [--load-state file] [--rewind-mb N]\n"
+                        "       [--run-ahead N] [--record movie] [--play movie] [--flamegraph file]\n"
+                        "       [--trace file] [--cpu-stats] [--turbo]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -812,52 +1064,243 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
 
     // check chip8 initialisation
-    chip8_t chip8;
+    chip8_t *chip8 = chip8_create();
     const char *rom_name = argv[1];
-    if (!init_chip8(&chip8, rom_name))
+    if (!chip8)
+        exit(EXIT_FAILURE);
+
+    // seed random number generator, resets keep replaying the same sequence
+    chip8_seed(chip8, config.seed);
+    if (!chip8_load_rom_file(chip8, rom_name))
         exit(EXIT_FAILURE);
 
+    // resume from a saved state; the rom stays loaded for resets
+    if (config.load_state && !chip8_load_state_file(chip8, config.load_state))
+        exit(EXIT_FAILURE);
+
+    // every interpreted instruction from here on, rendered by tools/trace2txt
+    if (config.trace_file && !chip8_trace_start(chip8, config.trace_file))
+        SDL_Log("Could not trace to '%s', tracing needs a core built with DEBUG (make debug)\n", config.trace_file);
+
+    // the emulation thread's state, set up here before it starts
+    static emulator_t emulator;
+    shared_t shared;
+    memset(&shared, 0, sizeof shared);
+    emulator.config = &config;
+    emulator.shared = &shared;
+    emulator.chip8 = chip8;
+    emulator.turbo = config.turbo;
+
+    // a movie is played from its own start state with the settings it was
+    // recorded with, or recorded from the state the machine is in now
+    chip8_movie_t *movie = &emulator.movie;
+    if (config.play_movie)
+    {
+        if (!chip8_load_movie_file(movie, config.play_movie))
+            exit(EXIT_FAILURE);
+        config.core = movie->config;
+        config.insts_per_second = movie->insts_per_second;
+        chip8_movie_start(movie, chip8, &emulator.movie_position);
+        emulator.playing = true;
+    }
+    else if (config.record_movie)
+        chip8_movie_begin(movie, chip8, &config.core, config.insts_per_second);
+
+    // recompiled blocks are only usable with the rom they came from
+    if (config.core.backend == BACKEND_AOT && !chip8_aot_matches_rom(chip8))
+    {
+        SDL_Log("Rom '%s' does not match the recompiled rom, using the interpreter\n", rom_name);
+        config.core.backend = BACKEND_CACHED;
+    }
+
+    // hold backspace to step back through the recorded frames
+    chip8_rewind_t *rewind = NULL;
+    if (config.rewind_mb > 0 && !config.record_movie && !config.play_movie)
+    {
+        rewind = chip8_rewind_create((size_t)config.rewind_mb << 20, REWIND_KEYFRAME_INTERVAL);
+        if (!rewind)
+            SDL_Log("Could not allocate a %u MB rewind buffer, rewinding disabled\n", config.rewind_mb);
+    }
+
+    emulator.rewind = rewind;
+
     // clear the window to bg-color
     clear_screen(config, sdl);
 
-    // seed random number generator
-    srand(time(NULL));
+    // turbo publishes frames and the render thread draws them at most once
+    // per display refresh; a little early so no 60 Hz frame is dropped
+    SDL_DisplayMode display_mode;
+    const int refresh_rate = SDL_GetWindowDisplayMode(sdl.window, &display_mode) == 0 && display_mode.refresh_rate > 0
+                                 ? display_mode.refresh_rate
+                                 : FRAME_RATE;
+    const uint64_t frequency = SDL_GetPerformanceFrequency();
+    const uint64_t refresh_ticks = frequency / refresh_rate;
+    emulator.publish_ticks = refresh_ticks;
+
+    shared.wake = SDL_CreateSemaphore(0);
+    shared.frame_event = SDL_RegisterEvents(1);
+    shared.frames.back = 0;
+    shared.frames.front = 1;
+    shared.frames.shared = 2;
+    if (!shared.wake || shared.frame_event == (uint32_t)-1)
+    {
+        SDL_Log("Could not set up the emulation thread %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
 
-    // main emulator loop
-    while (chip8.state != QUIT)
+    // the core runs on its own thread from here on; this one only handles
+    // input, audio and drawing, so a slow present never delays a frame
+    const uint64_t cpu_wall_start = chip8_time_ns();
+    const uint64_t cpu_start = chip8_cpu_time_ns();
+    SDL_Thread *thread = SDL_CreateThread(run_emulator, "emulation", &emulator);
+    if (!thread)
     {
-        // handle user inputs
-        handle_inputs(&chip8);
+        SDL_Log("Could not start the emulation thread %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
 
-        if (chip8.state == PAUSED)
-            continue;
+    // render loop: sleep until input or a new frame, draw the rows that
+    // changed since the last present
+    static uint64_t presented[DISPLAY_HEIGHT];
+    bool exposed = false;
+    bool sound = false;
+    bool title_turbo = false;
+    uint64_t title_time = 0, title_frames = 0, title_insts = 0;
+    uint64_t next_render = 0;
+    uint64_t render_ticks = 0;
+    uint64_t frames_presented = 0;
+    uint64_t frames_skipped = 0;
+    while (handle_inputs(&shared, &exposed))
+    {
+        const uint64_t now = SDL_GetPerformanceCounter();
+        const bool fresh = __atomic_load_n(&shared.frames.shared, __ATOMIC_ACQUIRE) & TRIPLE_FRESH;
+        if ((fresh && now >= next_render) || exposed)
+        {
+            __atomic_store_n(&shared.frame_signalled, 0, __ATOMIC_RELEASE);
+            const frame_t *frame = triple_take(&shared.frames);
+
+            // update window with changes, leaving it alone if nothing was drawn
+            uint32_t dirty_rows = changed_rows(frame->display, presented);
+            if (exposed)
+                dirty_rows = ~0u;
+            exposed = false;
+            if (dirty_rows)
+            {
+                const uint64_t render_start = SDL_GetPerformanceCounter();
+                update_screen(sdl, config, frame->display, dirty_rows);
+                render_ticks += SDL_GetPerformanceCounter() - render_start;
+                frames_presented++;
+                next_render = now + refresh_ticks * 3 / 4;
+            }
+            else
+                frames_skipped++;
 
-        // get time before running instructions
-        const uint64_t start_time = SDL_GetPerformanceCounter();
+            if (frame->sound != sound)
+            {
+                SDL_PauseAudioDevice(sdl.dev, frame->sound ? 0 : 1);
+                sound = frame->sound;
+            }
 
-        // emulate chip8 instructions for this frame (60hz)
-        for(uint32_t i = 0; i < config.insts_per_second / 60; i++)
-            emulate_instructions(&chip8, config);
+            // emulated MIPS and the multiple of real time in the title
+            if (frame->turbo && !title_turbo)
+            {
+                title_time = now;
+                title_frames = frame->frames;
+                title_insts = frame->insts;
+                title_turbo = true;
+            }
+            else if (frame->turbo && now - title_time >= frequency)
+            {
+                const double seconds = (double)(now - title_time) / frequency;
+                char title[128];
+                snprintf(title, sizeof title, "%s - turbo %.2f MIPS, %.0fx", WINDOW_TITLE,
+                         (frame->insts - title_insts) / seconds / 1e6, (frame->frames - title_frames) / seconds / FRAME_RATE);
+                SDL_SetWindowTitle(sdl.window, title);
+                title_time = now;
+                title_frames = frame->frames;
+                title_insts = frame->insts;
+            }
+            else if (!frame->turbo && title_turbo)
+            {
+                SDL_SetWindowTitle(sdl.window, WINDOW_TITLE);
+                title_turbo = false;
+            }
+        }
 
-        // get time after running instructions
-        const uint64_t end_time = SDL_GetPerformanceCounter();
+        // a frame held back by the refresh cap is due before any input
+        uint32_t wait_ms = EVENT_WAIT_MS;
+        if (fresh && now < next_render)
+            wait_ms = (uint32_t)((next_render - now) * 1000 / frequency) + 1;
+        SDL_WaitEventTimeout(NULL, (int)wait_ms);
+    }
 
-        // delay to maintain 60 fps
-        const double time_elapsed = (double)((end_time - start_time) * 1000) / SDL_GetPerformanceFrequency();
-        const double actual_delay = time_elapsed < 16.67f ? 16.67f - time_elapsed : 0;
-        SDL_Delay(actual_delay);
+    send_commands(&shared, COMMAND_QUIT);
+    SDL_WaitThread(thread, NULL);
+    SDL_DestroySemaphore(shared.wake);
 
-        // update window with changes
-        update_screen(sdl, config, chip8);
-        if(chip8.draw){
-            update_screen(sdl, config, chip8);
-            chip8.draw = false;
-        }
+    if (emulator.turbo_ticks > 0)
+    {
+        const double seconds = (double)emulator.turbo_ticks / frequency;
+        printf("turbo: %llu frames in %.1f s, %.2f MIPS, %.0fx real time\n", (unsigned long long)emulator.turbo_frames,
+               seconds, emulator.turbo_insts / seconds / 1e6, emulator.turbo_frames / seconds / FRAME_RATE);
+    }
 
-        // upadate sound timer
-        update_timers(sdl, &chip8);
+    if (config.cpu_stats)
+        printf("cpu: %.1f ms per second on average\n",
+               (chip8_cpu_time_ns() - cpu_start) / 1e6 / ((chip8_time_ns() - cpu_wall_start) / 1e9));
+
+    // rate actually run, per second of emulated time
+    const uint64_t frames_run = emulator.frames_run;
+    const uint64_t insts_requested = emulator.insts_requested;
+    if (frames_run > 0)
+    {
+        const double insts_per_second = (double)insts_requested * FRAME_RATE / frames_run;
+        if (config.core.cycle_costs)
+            printf("speed: %u cycles per second set, %.1f instructions per second run\n", config.insts_per_second,
+                   insts_per_second);
+        else
+            printf("speed: %u instructions per second set, %.1f run\n", config.insts_per_second, insts_per_second);
+    }
+
+    if (config.core.idle_skip && insts_requested > 0)
+        printf("idle loops: %llu of %llu instructions skipped (%.1f%%)\n", (unsigned long long)chip8->idle_skipped,
+               (unsigned long long)insts_requested, 100.0 * chip8->idle_skipped / insts_requested);
+
+    print_scheduler_stats(&emulator.scheduler);
+
+    if (frames_presented > 0)
+        printf("render: %llu of %llu published frames presented, %llu unchanged, %.1f us per presented frame\n",
+               (unsigned long long)frames_presented, (unsigned long long)emulator.frames_published,
+               (unsigned long long)frames_skipped,
+               render_ticks * 1e6 / SDL_GetPerformanceFrequency() / frames_presented);
+
+    if (chip8_profile_report(chip8) && config.flamegraph && chip8_profile_write_folded(chip8, config.flamegraph))
+        printf("Call stacks written to '%s'\n", config.flamegraph);
+
+    if (config.record_movie && chip8_save_movie_file(movie, config.record_movie))
+        printf("movie: %llu frames with %u key changes saved to '%s'\n", (unsigned long long)movie->end.frames,
+               movie->event_count, config.record_movie);
+    chip8_movie_free(movie);
+
+    if (emulator.run_ahead_count > 0)
+        printf("run-ahead: %u frames ahead, %.1f us per frame for the hidden frames and rollback\n",
+               config.run_ahead, emulator.run_ahead_ns / 1e3 / emulator.run_ahead_count);
+
+    if (rewind)
+    {
+        const chip8_rewind_stats_t *stats = chip8_rewind_stats(rewind);
+        if (stats->frames_pushed > 0)
+            printf("rewind: %llu frames held (%.1f s) in %llu bytes, %.1f bytes per frame, %llu keyframes\n",
+                   (unsigned long long)stats->frames_held, stats->frames_held / 60.0,
+                   (unsigned long long)stats->bytes_held, (double)stats->bytes_pushed / stats->frames_pushed,
+                   (unsigned long long)stats->keyframes_pushed);
+        if (stats->frames_popped > 0)
+            printf("rewind: %llu frames restored, %.0f ns per restore\n", (unsigned long long)stats->frames_popped,
+                   (double)stats->pop_ns / stats->frames_popped);
+        chip8_rewind_destroy(rewind);
     }
 
+    chip8_destroy(chip8);
     final_cleanup(sdl);
 
     exit(EXIT_SUCCESS);
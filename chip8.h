@@ -0,0 +1,373 @@
+// libchip8: headless chip8 core
+//
+// Everything needed to load a rom, run instructions, tick the timers, feed
+// the keypad and read the framebuffer, with no SDL dependency. The SDL
+// frontend in chip8.c and the tools in tools/ are clients of this API.
+
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// display resolution; a row is packed into one 64-bit word
+#define DISPLAY_WIDTH 64
+#define DISPLAY_HEIGHT 32
+
+typedef enum
+{
+    QUIT,
+    RUNNING,
+    PAUSED
+} emu_state_t;
+
+// instruction decoding strategies
+typedef enum
+{
+    BACKEND_SWITCH, // nested switch on the opcode nibbles
+    BACKEND_TABLE,  // handler lookup in a 64K opcode table
+    BACKEND_CACHED, // table handlers run from the predecoded instruction cache
+    BACKEND_JIT,    // native x86-64 blocks, cached interpreter for the rest
+    BACKEND_AOT,    // rom recompiled to C ahead of time by tools/ch8c
+    BACKEND_COUNT
+} backend_t;
+
+// settings of the core itself, independent of any frontend
+typedef struct
+{
+    backend_t backend;
+    bool idle_skip;   // fast-forward loops that only wait for a timer tick or input
+    bool cycle_costs; // chip8_run_cycles charges heavy opcodes more than one cycle
+} core_config_t;
+
+typedef struct
+{
+    uint16_t opcode;
+    uint16_t NNN; // 12-bit address
+    uint8_t NN;   // 8-bit address
+    uint8_t N;    // 4-bit address
+    uint8_t X;    // 4-bit register
+    uint8_t Y;    // 4-bit register
+} instruction_t;
+
+typedef struct
+{
+    instruction_t inst; // operands decoded once
+    uint8_t handler;    // index into the dispatch handler list
+    bool valid;         // false until decoded, cleared when ram under it changes
+} decoded_inst_t;
+
+typedef struct jit_t jit_t;
+typedef struct chip8_profile_t chip8_profile_t;
+typedef struct chip8_trace_t chip8_trace_t;
+
+typedef struct
+{
+    emu_state_t state;
+    uint8_t ram[4096];     // total ram
+    uint64_t display[DISPLAY_HEIGHT]; // one bit per pixel, bit 63 is the leftmost column
+    uint16_t stack[12];     // subroutine/callback stack
+    uint16_t *stack_ptr;   // points to top of stack
+    uint8_t V[16];         // data registers V[0] - V[F]
+    uint16_t I;            // index register
+    uint16_t PC;           // program counter
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    bool keypad[16];      // hexadecimal keypad 0x0 - 0xF
+    const char *rom_name; // current rom file
+    instruction_t inst;   // current instruction
+    uint32_t dirty_rows;  // bit per display row changed since the screen was last presented
+    decoded_inst_t decoded[4096]; // predecoded instruction per ram address
+    jit_t *jit;                   // recompiler state, NULL until the jit backend runs
+    uint64_t ram_written[4096 / 64]; // bitmap of ram bytes stored to since the rom was loaded
+    uint64_t idle_skipped;        // instructions fast-forwarded by idle loop detection
+    uint64_t rng_seed;            // CXNN seed, kept across rom loads
+    uint64_t rng_state;           // xorshift64* state, restarted from rng_seed on load
+    chip8_profile_t *profile;     // opcode profile, only allocated in PROFILE builds
+    chip8_trace_t *trace;         // binary execution trace, NULL unless started in a DEBUG build
+    uint64_t cycles;              // cycles run by chip8_run_cycles, kept across rom loads and state restores
+} chip8_t;
+
+// machine state without pointers or host resources: a snapshot can be taken
+// or restored every frame, and serialised to the versioned file format
+typedef struct
+{
+    uint8_t ram[4096];
+    uint64_t display[DISPLAY_HEIGHT];
+    uint16_t stack[12];
+    uint8_t stack_depth; // entries in use, stack_ptr - stack
+    uint8_t V[16];
+    uint16_t I;
+    uint16_t PC;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint16_t keys; // keypad bitmask, bit n is key n
+    uint64_t rng_seed;
+    uint64_t rng_state;
+    uint64_t ram_written[4096 / 64];
+} chip8_state_t;
+
+// serialised state: "C8ST", u16 version, u16 flags, u32 payload bytes, then
+// every field of chip8_state_t in order, little endian
+#define CHIP8_STATE_VERSION 1
+#define CHIP8_STATE_HEADER_BYTES 12
+#define CHIP8_STATE_BYTES (CHIP8_STATE_HEADER_BYTES + 4096 + DISPLAY_HEIGHT * 8 + 12 * 2 + 1 + 16 + 2 + 2 + 1 + 1 + 2 + 8 + 8 + 64 * 8)
+
+// allocate a zeroed instance; load a rom before running it
+chip8_t *chip8_create(void);
+void chip8_destroy(chip8_t *chip8);
+
+// reset the machine and load a rom from memory or from a file; rom_name is
+// kept by pointer for reloading and messages
+bool chip8_load_rom(chip8_t *chip8, const uint8_t *rom, size_t rom_size, const char *rom_name);
+bool chip8_load_rom_file(chip8_t *chip8, const char *rom_name);
+
+// CXNN generator, shared by the scalar and lockstep engines: xorshift64*
+// seeded through the splitmix64 finaliser so any seed gives a non-zero state
+static inline uint64_t chip8_rng_from_seed(uint64_t seed)
+{
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+// next random byte, taken from the well mixed top bits
+static inline uint8_t chip8_rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (uint8_t)((*state * 0x2545F4914F6CDD1Dull) >> 56);
+}
+
+// set the CXNN random seed and restart its sequence; each instance has its own
+// generator, so runs with the same seed and input are reproducible
+void chip8_seed(chip8_t *chip8, uint64_t seed);
+
+// copy the machine state out, or back in; restoring only drops the cached
+// and recompiled code under ram bytes that differ
+void chip8_snapshot(const chip8_t *chip8, chip8_state_t *state);
+void chip8_restore(chip8_t *chip8, const chip8_state_t *state);
+
+// state <-> CHIP8_STATE_BYTES buffer in the file format; deserialising
+// rejects other versions and malformed buffers
+void chip8_state_serialize(const chip8_state_t *state, uint8_t *buffer);
+bool chip8_state_deserialize(const uint8_t *buffer, size_t size, chip8_state_t *state);
+
+// save or load the machine state as a file
+bool chip8_save_state_file(const chip8_t *chip8, const char *file_name);
+bool chip8_load_state_file(chip8_t *chip8, const char *file_name);
+
+// input movie: a start state plus every keypad change, keyed by frame number
+// and instruction count. Replaying the changes from the start state with a
+// frame clock at the recorded rate and cycle costs reproduces every
+// framebuffer bit for bit; a hash of all of them is kept to check that.
+typedef struct
+{
+    uint64_t frame; // the keys are set before this frame runs
+    uint64_t insts; // instructions requested before the change
+    uint16_t keys;  // keypad bitmask from then on
+} chip8_movie_event_t;
+
+// where a recording or playback is: frames and instructions run so far and
+// the framebuffer after each frame folded into one hash
+typedef struct
+{
+    uint64_t frames;
+    uint64_t insts;
+    uint64_t display_hash;
+    uint32_t next_event; // playback only, next event to apply
+} chip8_movie_position_t;
+
+typedef struct
+{
+    uint64_t seed;             // CXNN seed, also part of the start state
+    uint32_t insts_per_second; // frame clock rate it was recorded with
+    core_config_t config;      // backend, idle skipping and cycle costs it was recorded with
+    chip8_state_t start;
+    chip8_movie_event_t *events;
+    uint32_t event_count;
+    uint32_t event_capacity;
+    chip8_movie_position_t end; // recording position, the expected end on playback
+} chip8_movie_t;
+
+// serialised movie: "C8MV", u16 version, u16 flags, u64 seed, u32 insts per
+// second, u8 backend, u8 idle skip, u8 cycle costs, u64 frames, u64 insts,
+// u64 display hash, u32 event count, the start state as a state file, then
+// per event u64 frame, u64 insts, u16 keys; little endian
+#define CHIP8_MOVIE_VERSION 2
+#define CHIP8_MOVIE_HEADER_BYTES (4 + 2 + 2 + 8 + 4 + 1 + 1 + 1 + 8 + 8 + 8 + 4)
+#define CHIP8_MOVIE_EVENT_BYTES (8 + 8 + 2)
+
+// recording: begin from the current state, then once per frame record the
+// keys before it runs and end the frame, with the instructions it ran, after
+// its timers ticked
+void chip8_movie_begin(chip8_movie_t *movie, const chip8_t *chip8, const core_config_t *config, uint32_t insts_per_second);
+bool chip8_movie_record_keys(chip8_movie_t *movie, const chip8_t *chip8);
+void chip8_movie_end_frame(chip8_movie_position_t *position, const chip8_t *chip8, uint64_t insts);
+
+// playback: restore the start state, then once per frame set the recorded
+// keys before it runs and end the frame as when recording; false once the
+// movie is over or it no longer lines up with the instruction count
+void chip8_movie_start(const chip8_movie_t *movie, chip8_t *chip8, chip8_movie_position_t *position);
+bool chip8_movie_play_keys(const chip8_movie_t *movie, chip8_movie_position_t *position, chip8_t *chip8);
+
+// save or load a movie file; free releases the events of a loaded or
+// recorded movie
+bool chip8_save_movie_file(const chip8_movie_t *movie, const char *file_name);
+bool chip8_load_movie_file(chip8_movie_t *movie, const char *file_name);
+void chip8_movie_free(chip8_movie_t *movie);
+
+// default core settings
+void chip8_default_config(core_config_t *config);
+
+// backend names as used on command lines: switch, table, cached, jit, aot
+const char *chip8_backend_name(backend_t backend);
+bool chip8_backend_from_name(const char *name, backend_t *backend);
+
+// true if the aot backend was built in and recompiled from the loaded rom
+bool chip8_aot_matches_rom(const chip8_t *chip8);
+
+// run count instructions
+void chip8_run(chip8_t *chip8, const core_config_t *config, uint32_t count);
+
+// run up to a cycle deadline on chip8->cycles: one cycle per instruction,
+// or with config->cycle_costs more for DXYN, 00E0, FX55 and the like. The
+// last instruction may pass the deadline; keep deadlines absolute and the
+// overshoot comes out of the next run. With cycle costs the interpreters step
+// one instruction at a time, jit and aot still run whole blocks. Returns the
+// instructions run
+uint64_t chip8_run_cycles(chip8_t *chip8, const core_config_t *config, uint64_t deadline);
+
+// 60 Hz frames at any rate: each frame runs to the next cycle deadline, the
+// remainder of insts_per_second / 60 carried in sixtieths, so 700 gives 11
+// or 12 a frame and 700 a second. Start the clock on the instance it drives;
+// a copy runs the same frames from the same state
+typedef struct
+{
+    uint64_t deadline;
+    uint32_t insts_per_second;
+    uint32_t remainder;
+} chip8_frame_clock_t;
+
+void chip8_frame_clock_start(chip8_frame_clock_t *clock, const chip8_t *chip8, uint32_t insts_per_second);
+
+// cycles in the next frame, moving the deadline past them
+uint32_t chip8_frame_clock_advance(chip8_frame_clock_t *clock);
+
+// run the next frame, returning the instructions run
+uint64_t chip8_run_frame(chip8_t *chip8, const core_config_t *config, chip8_frame_clock_t *clock);
+
+// count down delay and sound timers, called at 60hz
+void chip8_tick_timers(chip8_t *chip8);
+
+// true while the machine sits in an idle loop that only keypad input can end
+// and both timers are stopped, so a frontend can sleep until the next event
+bool chip8_waiting_for_input(const chip8_t *chip8);
+
+// keypad input, one key or all 16 as a bitmask (bit n is key n)
+void chip8_set_key(chip8_t *chip8, uint8_t key, bool down);
+void chip8_set_keys(chip8_t *chip8, uint16_t keys);
+
+// DISPLAY_HEIGHT packed rows, bit 63 of each is the leftmost pixel
+const uint64_t *chip8_framebuffer(const chip8_t *chip8);
+
+// monotonic host clock in nanoseconds, for timing runs
+uint64_t chip8_time_ns(void);
+
+// host CPU time used by the process so far in nanoseconds
+uint64_t chip8_cpu_time_ns(void);
+
+// opcode profile of a core built with -DPROFILE: executions and host time
+// per opcode class, executions per address and per call stack, on the
+// interpreter paths. The report goes to stdout sorted by time, the call
+// stacks to a folded-stack file for flamegraph tools; both return false when
+// the profiler is compiled out.
+bool chip8_profile_report(const chip8_t *chip8);
+bool chip8_profile_write_folded(const chip8_t *chip8, const char *file_name);
+void chip8_profile_reset(chip8_t *chip8);
+
+// binary execution trace of a core built with -DDEBUG: one record per
+// interpreted instruction, queued in a lock-free ring and written to the file
+// by a background thread. Start returns false when tracing is compiled out;
+// destroying the instance stops its trace. tools/trace2txt renders it.
+//
+// File: "C8TR", u16 version, then records, little endian:
+//   instruction: u8 0, u16 PC, u16 opcode, u8 n, n x (u16 target, u16 value)
+//   sync:        u8 1, V[0..F], u16 I, u8 delay timer, u8 sound timer
+// A target below 0x1000 is a ram byte written, the others are below. A sync
+// record comes first and wherever the registers changed outside traced
+// instructions (timer ticks, restores, recompiled code).
+#define CHIP8_TRACE_VERSION 1
+#define CHIP8_TRACE_INSTRUCTION 0
+#define CHIP8_TRACE_SYNC 1
+#define CHIP8_TRACE_V 0x1000     // + register index, its new value
+#define CHIP8_TRACE_I 0x1010
+#define CHIP8_TRACE_DELAY 0x1011
+#define CHIP8_TRACE_SOUND 0x1012
+#define CHIP8_TRACE_PC 0x1013    // next PC when it is not the following instruction
+#define CHIP8_TRACE_KEY 0x1014   // keypad state read by EX9E/EXA1
+#define CHIP8_TRACE_MAX_CHANGES 48
+
+bool chip8_trace_start(chip8_t *chip8, const char *file_name);
+void chip8_trace_stop(chip8_t *chip8);
+
+// rewind buffer: one frame per push in a ring capped at memory_cap bytes,
+// coded as XOR/RLE deltas against a keyframe every keyframe_interval frames;
+// pop restores the newest frame and drops it (see rewind.c)
+typedef struct chip8_rewind_t chip8_rewind_t;
+
+typedef struct
+{
+    uint64_t frames_pushed;
+    uint64_t keyframes_pushed;
+    uint64_t bytes_pushed; // coded bytes over all pushes
+    uint64_t frames_held;  // frames that can currently be rewound
+    uint64_t bytes_held;
+    uint64_t frames_popped;
+    uint64_t pop_ns; // time spent decoding and restoring popped frames
+} chip8_rewind_stats_t;
+
+chip8_rewind_t *chip8_rewind_create(size_t memory_cap, uint32_t keyframe_interval);
+void chip8_rewind_destroy(chip8_rewind_t *rewind);
+void chip8_rewind_clear(chip8_rewind_t *rewind);
+bool chip8_rewind_push(chip8_rewind_t *rewind, const chip8_t *chip8);
+bool chip8_rewind_pop(chip8_rewind_t *rewind, chip8_t *chip8);
+const chip8_rewind_stats_t *chip8_rewind_stats(const chip8_rewind_t *rewind);
+
+// lockstep engine running up to CHIP8_SOA_LANES instances of one rom with
+// their state in structure-of-arrays form; lanes sharing a PC execute each
+// instruction together, lanes that diverged run on their own (see soa.c)
+#define CHIP8_SOA_LANES 32
+
+typedef struct chip8_soa_t chip8_soa_t;
+
+typedef struct
+{
+    uint64_t lane_insts;    // instructions executed summed over lanes
+    uint64_t vector_issues; // opcode passes shared by two or more lanes
+    uint64_t scalar_issues; // opcode passes run for a single lane
+} chip8_soa_stats_t;
+
+chip8_soa_t *chip8_soa_create(void);
+void chip8_soa_destroy(chip8_soa_t *soa);
+bool chip8_soa_load_rom(chip8_soa_t *soa, uint32_t lanes, const uint8_t *rom, size_t rom_size, const char *rom_name);
+void chip8_soa_run(chip8_soa_t *soa, uint32_t count);
+void chip8_soa_tick_timers(chip8_soa_t *soa);
+void chip8_soa_set_key(chip8_soa_t *soa, uint32_t lane, uint8_t key, bool down);
+void chip8_soa_seed(chip8_soa_t *soa, uint32_t lane, uint64_t seed);
+void chip8_soa_read_lane(const chip8_soa_t *soa, uint32_t lane, chip8_t *chip8);
+const chip8_soa_stats_t *chip8_soa_stats(const chip8_soa_t *soa);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIP8_H
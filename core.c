@@ -0,0 +1,2765 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+
+// the recompiler backend is only built for x86-64 hosts
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIP8_JIT
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(CHIP8_JIT)
+#include <sys/mman.h>
+#endif
+
+// the trace writer runs on its own thread
+#ifdef DEBUG
+#include <pthread.h>
+#endif
+
+static void jit_flush(jit_t *jit);
+static void jit_invalidate(jit_t *jit, uint16_t address);
+static void jit_destroy(chip8_t *chip8);
+static uint32_t cycle_cost(uint16_t opcode);
+static uint64_t run_interpreted_cycles(chip8_t *chip8, backend_t backend, uint64_t deadline);
+#ifdef DEBUG
+static void trace_write(chip8_t *chip8, uint16_t address, uint8_t value);
+#endif
+
+// drop predecoded instructions and native blocks that overlap a ram byte
+static inline void invalidate_code(chip8_t *chip8, uint16_t address)
+{
+    chip8->decoded[address & 0xFFF].valid = false;
+    chip8->decoded[(address - 1) & 0xFFF].valid = false;
+
+    if (chip8->jit)
+        jit_invalidate(chip8->jit, address);
+}
+
+// store a byte in ram, dropping predecoded instructions that overlap it;
+// addresses past the end wrap like every other ram access
+static inline void ram_write(chip8_t *chip8, uint16_t address, uint8_t value)
+{
+    address &= 0xFFF;
+    chip8->ram[address] = value;
+    chip8->ram_written[address / 64] |= 1ull << (address % 64);
+    invalidate_code(chip8, address);
+
+#ifdef DEBUG
+    if (chip8->trace)
+        trace_write(chip8, address, value);
+#endif
+}
+
+// XOR an 8 pixel wide, n row sprite from ram[I] onto the display at (x, y);
+// sprites wrap to the screen by their origin only and clip at the edges
+static inline void draw_sprite(chip8_t *chip8, uint8_t x, uint8_t y, uint8_t n)
+{
+    const uint8_t x_coord = x % DISPLAY_WIDTH;
+    const uint8_t y_coord = y % DISPLAY_HEIGHT;
+    const uint8_t rows = y_coord + n > DISPLAY_HEIGHT ? DISPLAY_HEIGHT - y_coord : n;
+    uint64_t collision = 0;
+
+    for (uint8_t i = 0; i < rows; i++)
+    {
+        // shift the sprite byte to its column, bits past the right edge fall off
+        const uint64_t sprite_data = chip8->ram[(chip8->I + i) & 0xFFF];
+        const uint64_t sprite_row = x_coord <= 56 ? sprite_data << (56 - x_coord) : sprite_data >> (x_coord - 56);
+
+        collision |= chip8->display[y_coord + i] & sprite_row;
+        chip8->display[y_coord + i] ^= sprite_row;
+        chip8->dirty_rows |= (uint32_t)(sprite_row != 0) << (y_coord + i);
+    }
+
+    chip8->V[0xF] = collision != 0;
+}
+
+// ---------------------------------------------------------------------------
+// binary execution trace, built with -DDEBUG: the interpreters record every
+// instruction with the registers and ram bytes it changed. Records are built
+// on the emulation thread, queued in a single producer single consumer byte
+// ring and written out by a background thread, so tracing costs a few dozen
+// nanoseconds per instruction instead of a formatted printf.
+// ---------------------------------------------------------------------------
+
+#ifdef DEBUG
+
+#define TRACE_RING_SIZE (1u << 22) // power of two
+#define TRACE_MAX_RECORD (6 + CHIP8_TRACE_MAX_CHANGES * 4)
+
+struct chip8_trace_t
+{
+    uint8_t *ring;
+    uint64_t head; // bytes queued, only stored by the emulation thread
+    uint64_t tail; // bytes written, only stored by the writer thread
+    bool stop;
+    FILE *file;
+    pthread_t writer;
+
+    // record of the instruction being traced
+    uint8_t record[TRACE_MAX_RECORD];
+    uint8_t change_count;
+    uint16_t pc;
+
+    // registers as the last record left them, to find changes
+    uint8_t V[16];
+    uint16_t I;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    bool synced;
+};
+
+static void trace_pause(uint32_t ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    const struct timespec delay = {0, (long)ms * 1000000};
+    nanosleep(&delay, NULL);
+#endif
+}
+
+// copy whole records into the ring, waiting for the writer if it is full
+static void trace_queue(chip8_trace_t *trace, const uint8_t *data, uint32_t size)
+{
+    while (trace->head + size - __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) > TRACE_RING_SIZE)
+        trace_pause(0);
+
+    for (uint32_t i = 0; i < size; i++)
+        trace->ring[(trace->head + i) & (TRACE_RING_SIZE - 1)] = data[i];
+    __atomic_store_n(&trace->head, trace->head + size, __ATOMIC_RELEASE);
+}
+
+static void *trace_writer(void *arg)
+{
+    chip8_trace_t *trace = (chip8_trace_t *)arg;
+    for (;;)
+    {
+        const bool stop = __atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE);
+        const uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+        if (head == trace->tail)
+        {
+            if (stop)
+                return NULL;
+            trace_pause(1);
+            continue;
+        }
+
+        // at most up to the end of the ring, the rest on the next pass
+        const uint32_t start = trace->tail & (TRACE_RING_SIZE - 1);
+        const uint32_t size = head - trace->tail < TRACE_RING_SIZE - start ? (uint32_t)(head - trace->tail) : TRACE_RING_SIZE - start;
+        fwrite(&trace->ring[start], 1, size, trace->file);
+        __atomic_store_n(&trace->tail, trace->tail + size, __ATOMIC_RELEASE);
+    }
+}
+
+static void trace_change(chip8_trace_t *trace, uint16_t target, uint16_t value)
+{
+    uint8_t *out = &trace->record[6 + trace->change_count++ * 4];
+    out[0] = (uint8_t)target;
+    out[1] = (uint8_t)(target >> 8);
+    out[2] = (uint8_t)value;
+    out[3] = (uint8_t)(value >> 8);
+}
+
+// called after the fetch moved PC past the instruction, before it runs
+static void trace_begin(chip8_t *chip8)
+{
+    chip8_trace_t *trace = chip8->trace;
+
+    // registers changed since the last record, write them all out first
+    if (!trace->synced || memcmp(trace->V, chip8->V, sizeof trace->V) != 0 || trace->I != chip8->I ||
+        trace->delay_timer != chip8->delay_timer || trace->sound_timer != chip8->sound_timer)
+    {
+        uint8_t sync[1 + 16 + 2 + 1 + 1] = {CHIP8_TRACE_SYNC};
+        memcpy(&sync[1], chip8->V, sizeof chip8->V);
+        sync[17] = (uint8_t)chip8->I;
+        sync[18] = (uint8_t)(chip8->I >> 8);
+        sync[19] = chip8->delay_timer;
+        sync[20] = chip8->sound_timer;
+        trace_queue(trace, sync, sizeof sync);
+
+        memcpy(trace->V, chip8->V, sizeof trace->V);
+        trace->I = chip8->I;
+        trace->delay_timer = chip8->delay_timer;
+        trace->sound_timer = chip8->sound_timer;
+        trace->synced = true;
+    }
+
+    trace->pc = chip8->PC - 2;
+    trace->record[0] = CHIP8_TRACE_INSTRUCTION;
+    trace->record[1] = (uint8_t)trace->pc;
+    trace->record[2] = (uint8_t)(trace->pc >> 8);
+    trace->record[3] = (uint8_t)chip8->inst.opcode;
+    trace->record[4] = (uint8_t)(chip8->inst.opcode >> 8);
+    trace->change_count = 0;
+
+    // key tests depend on input the trace has no other record of
+    if ((chip8->inst.opcode & 0xF0FF) == 0xE09E || (chip8->inst.opcode & 0xF0FF) == 0xE0A1)
+        trace_change(trace, CHIP8_TRACE_KEY, chip8->keypad[chip8->V[chip8->inst.X] & 0xF]);
+}
+
+static void trace_write(chip8_t *chip8, uint16_t address, uint8_t value)
+{
+    chip8_trace_t *trace = chip8->trace;
+    if (trace->change_count < CHIP8_TRACE_MAX_CHANGES)
+        trace_change(trace, address & 0xFFF, value);
+}
+
+// called after the instruction ran: diff the registers and queue the record
+static void trace_end(chip8_t *chip8)
+{
+    chip8_trace_t *trace = chip8->trace;
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        if (chip8->V[i] != trace->V[i])
+            trace_change(trace, CHIP8_TRACE_V + i, chip8->V[i]);
+    }
+    if (chip8->I != trace->I)
+        trace_change(trace, CHIP8_TRACE_I, chip8->I);
+    if (chip8->delay_timer != trace->delay_timer)
+        trace_change(trace, CHIP8_TRACE_DELAY, chip8->delay_timer);
+    if (chip8->sound_timer != trace->sound_timer)
+        trace_change(trace, CHIP8_TRACE_SOUND, chip8->sound_timer);
+    if (chip8->PC != trace->pc + 2)
+        trace_change(trace, CHIP8_TRACE_PC, chip8->PC);
+
+    trace->record[5] = trace->change_count;
+    trace_queue(trace, trace->record, 6 + trace->change_count * 4);
+
+    memcpy(trace->V, chip8->V, sizeof trace->V);
+    trace->I = chip8->I;
+    trace->delay_timer = chip8->delay_timer;
+    trace->sound_timer = chip8->sound_timer;
+}
+
+bool chip8_trace_start(chip8_t *chip8, const char *file_name)
+{
+    chip8_trace_stop(chip8);
+
+    chip8_trace_t *trace = (chip8_trace_t *)calloc(1, sizeof(chip8_trace_t));
+    if (!trace || !(trace->ring = (uint8_t *)malloc(TRACE_RING_SIZE)))
+    {
+        free(trace);
+        return false;
+    }
+
+    trace->file = fopen(file_name, "wb");
+    if (!trace->file)
+    {
+        fprintf(stderr, "Could not open trace file '%s' for writing!\n", file_name);
+        free(trace->ring);
+        free(trace);
+        return false;
+    }
+    const uint8_t header[6] = {'C', '8', 'T', 'R', CHIP8_TRACE_VERSION & 0xFF, CHIP8_TRACE_VERSION >> 8};
+    fwrite(header, 1, sizeof header, trace->file);
+
+    if (pthread_create(&trace->writer, NULL, trace_writer, trace) != 0)
+    {
+        fprintf(stderr, "Could not start the trace writer!\n");
+        fclose(trace->file);
+        free(trace->ring);
+        free(trace);
+        return false;
+    }
+
+    chip8->trace = trace;
+    return true;
+}
+
+// drain the ring and close the file
+void chip8_trace_stop(chip8_t *chip8)
+{
+    chip8_trace_t *trace = chip8->trace;
+    if (!trace)
+        return;
+
+    __atomic_store_n(&trace->stop, true, __ATOMIC_RELEASE);
+    pthread_join(trace->writer, NULL);
+    if (fclose(trace->file) != 0)
+        fprintf(stderr, "Could not write the trace file!\n");
+    free(trace->ring);
+    free(trace);
+    chip8->trace = NULL;
+}
+#else
+bool chip8_trace_start(chip8_t *chip8, const char *file_name)
+{
+    (void)chip8;
+    (void)file_name;
+    return false;
+}
+
+void chip8_trace_stop(chip8_t *chip8)
+{
+    (void)chip8;
+}
+#endif // DEBUG
+
+// ---------------------------------------------------------------------------
+// opcode profiler, built with -DPROFILE: executions and host time per opcode
+// class, taken around every instruction of the switch, table and cached
+// interpreters. The jit and aot backends only show up with the instructions
+// they hand to the interpreter. Compiled out, the hooks are empty.
+//
+// The same hook counts executions per PC and per call stack. A call stack is
+// a path in a trie of subroutines, found from the return addresses on the
+// chip8 stack: the 2NNN just before each names the subroutine it entered.
+// The trie is only walked again when the stack changed.
+// ---------------------------------------------------------------------------
+
+#ifdef PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define profile_ticks() __rdtsc()
+#else
+#define profile_ticks() chip8_time_ns()
+#endif
+
+// X, Y and N are operand digits, anything else must match; first match wins
+static const char *const profile_patterns[] = {
+    "00E0", "00EE", "0NNN", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN",
+    "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7", "8XYE", "9XY0",
+    "ANNN", "BNNN", "CXNN", "DXYN", "EX9E", "EXA1", "FX07", "FX0A", "FX15", "FX18",
+    "FX1E", "FX29", "FX33", "FX55", "FX65", "invalid",
+};
+#define PROFILE_CLASSES (sizeof profile_patterns / sizeof profile_patterns[0])
+
+// call trie limit; deeper or later stacks are counted in their nearest parent
+#define PROFILE_MAX_NODES 16384
+#define PROFILE_UNKNOWN_CALL 0xFFFF // return address not behind a 2NNN
+
+typedef struct
+{
+    uint16_t address;      // subroutine entered, unused for the root
+    uint16_t parent;
+    uint16_t first_child;  // 0 for none, the root is nobody's child
+    uint16_t next_sibling;
+    uint64_t insts;        // instructions run with exactly this call stack
+} profile_node_t;
+
+struct chip8_profile_t
+{
+    uint64_t count[PROFILE_CLASSES];
+    uint64_t ticks[PROFILE_CLASSES];
+    uint64_t start_ticks; // with start_ns, converts ticks to host time
+    uint64_t start_ns;
+
+    uint64_t pc_count[4096]; // executions per instruction address
+    profile_node_t nodes[PROFILE_MAX_NODES];
+    uint16_t node_count;
+    uint16_t node;           // trie node of the cached stack
+    uint16_t stack[12];      // stack the node was found for
+    uint8_t stack_depth;
+};
+
+static uint8_t profile_class[0x10000];
+static uint64_t profile_overhead; // ticks of an empty start/stop pair
+
+static bool profile_matches(const char *pattern, uint16_t opcode)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for (int i = 0; i < 4; i++)
+    {
+        const char digit = hex[(opcode >> (12 - 4 * i)) & 0xF];
+        if (pattern[i] != 'X' && pattern[i] != 'Y' && pattern[i] != 'N' && pattern[i] != digit)
+            return false;
+    }
+    return true;
+}
+
+// opcode -> class table, only built once per process
+static void init_profile_classes(void)
+{
+    static bool initialised = false;
+    if (initialised)
+        return;
+
+    for (uint32_t opcode = 0; opcode <= 0xFFFF; opcode++)
+    {
+        uint8_t id = 0;
+        while (id < PROFILE_CLASSES - 1 && !profile_matches(profile_patterns[id], (uint16_t)opcode))
+            id++;
+        profile_class[opcode] = id;
+    }
+
+    // the cheapest back to back read is what the counter itself costs
+    profile_overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; i++)
+    {
+        const uint64_t start = profile_ticks();
+        const uint64_t ticks = profile_ticks() - start;
+        if (ticks < profile_overhead)
+            profile_overhead = ticks;
+    }
+
+    initialised = true;
+}
+
+// child of parent for a call to address, added if there is room
+static uint16_t profile_child(chip8_profile_t *profile, uint16_t parent, uint16_t address)
+{
+    uint16_t child = profile->nodes[parent].first_child;
+    while (child && profile->nodes[child].address != address)
+        child = profile->nodes[child].next_sibling;
+    if (child || profile->node_count == PROFILE_MAX_NODES)
+        return child ? child : parent;
+
+    child = profile->node_count++;
+    profile->nodes[child].address = address;
+    profile->nodes[child].parent = parent;
+    profile->nodes[child].first_child = 0;
+    profile->nodes[child].next_sibling = profile->nodes[parent].first_child;
+    profile->nodes[child].insts = 0;
+    profile->nodes[parent].first_child = child;
+    return child;
+}
+
+// count the instruction just fetched against its address and call stack,
+// then start timing it; nothing is counted while the profile is detached
+static inline uint64_t profile_enter(chip8_t *chip8)
+{
+    chip8_profile_t *profile = chip8->profile;
+    if (!profile)
+        return 0;
+
+    const uint8_t depth = (uint8_t)(chip8->stack_ptr - chip8->stack);
+    if (depth != profile->stack_depth || memcmp(profile->stack, chip8->stack, depth * sizeof(uint16_t)) != 0)
+    {
+        uint16_t node = 0;
+        for (uint8_t i = 0; i < depth; i++)
+        {
+            const uint16_t call = chip8->stack[i] - 2;
+            const uint16_t opcode = (chip8->ram[call & 0xFFF] << 8) | chip8->ram[(call + 1) & 0xFFF];
+            node = profile_child(profile, node, (opcode >> 12) == 0x2 ? opcode & 0x0FFF : PROFILE_UNKNOWN_CALL);
+        }
+        profile->node = node;
+        profile->stack_depth = depth;
+        memcpy(profile->stack, chip8->stack, depth * sizeof(uint16_t));
+    }
+
+    profile->nodes[profile->node].insts++;
+    profile->pc_count[(chip8->PC - 2) & 0xFFF]++;
+    return profile_ticks();
+}
+
+static inline void profile_count(chip8_t *chip8, uint16_t opcode, uint64_t start)
+{
+    if (!chip8->profile)
+        return;
+
+    const uint8_t id = profile_class[opcode];
+    const uint64_t ticks = profile_ticks() - start;
+    chip8->profile->count[id]++;
+    chip8->profile->ticks[id] += ticks > profile_overhead ? ticks - profile_overhead : 0;
+}
+
+#define PROFILE_START(chip8) const uint64_t profile_start = profile_enter(chip8)
+#define PROFILE_STOP(chip8, opcode) profile_count(chip8, opcode, profile_start)
+
+void chip8_profile_reset(chip8_t *chip8)
+{
+    memset(chip8->profile, 0, sizeof(chip8_profile_t));
+    chip8->profile->node_count = 1; // the root, code outside any subroutine
+    chip8->profile->start_ticks = profile_ticks();
+    chip8->profile->start_ns = chip8_time_ns();
+}
+
+bool chip8_profile_report(const chip8_t *chip8)
+{
+    const chip8_profile_t *profile = chip8->profile;
+    uint64_t total_count = 0, total_ticks = 0;
+    uint8_t order[PROFILE_CLASSES];
+    for (uint8_t id = 0; id < PROFILE_CLASSES; id++)
+    {
+        total_count += profile->count[id];
+        total_ticks += profile->ticks[id];
+
+        // insertion sort by time, most expensive first
+        uint8_t i = id;
+        for (; i > 0 && profile->ticks[order[i - 1]] < profile->ticks[id]; i--)
+            order[i] = order[i - 1];
+        order[i] = id;
+    }
+
+    // calibrate the tick counter against the host clock over the whole profile
+    const uint64_t elapsed_ticks = profile_ticks() - profile->start_ticks;
+    const double ns_per_tick = elapsed_ticks ? (double)(chip8_time_ns() - profile->start_ns) / elapsed_ticks : 1.0;
+
+    printf("opcode profile: %llu instructions, %.2f ms\n", (unsigned long long)total_count,
+           total_ticks * ns_per_tick / 1e6);
+    printf("%-8s %12s %7s %10s %8s %7s\n", "opcode", "count", "count%", "ms", "ns/inst", "time%");
+    for (uint8_t i = 0; i < PROFILE_CLASSES; i++)
+    {
+        const uint8_t id = order[i];
+        if (profile->count[id] == 0)
+            continue;
+        printf("%-8s %12llu %6.1f%% %10.2f %8.1f %6.1f%%\n", profile_patterns[id], (unsigned long long)profile->count[id],
+               100.0 * profile->count[id] / total_count, profile->ticks[id] * ns_per_tick / 1e6,
+               profile->ticks[id] * ns_per_tick / profile->count[id], 100.0 * profile->ticks[id] / total_ticks);
+    }
+
+    // the 16 hottest instruction addresses, kept sorted while scanning
+    uint16_t hottest[16];
+    uint8_t hottest_count = 0;
+    for (uint16_t address = 0; address < 4096; address++)
+    {
+        if (profile->pc_count[address] == 0)
+            continue;
+
+        uint8_t i = hottest_count < 16 ? hottest_count++ : 16;
+        for (; i > 0 && profile->pc_count[hottest[i - 1]] < profile->pc_count[address]; i--)
+        {
+            if (i < 16)
+                hottest[i] = hottest[i - 1];
+        }
+        if (i < 16)
+            hottest[i] = address;
+    }
+
+    printf("\n%-8s %-8s %12s %7s\n", "address", "opcode", "count", "count%");
+    for (uint8_t i = 0; i < hottest_count; i++)
+    {
+        const uint16_t address = hottest[i];
+        printf("0x%03X    %02X%02X     %12llu %6.1f%%\n", address, chip8->ram[address], chip8->ram[(address + 1) & 0xFFF],
+               (unsigned long long)profile->pc_count[address], 100.0 * profile->pc_count[address] / total_count);
+    }
+    return true;
+}
+
+// one line per call stack: "main;sub_2A4;sub_310 <instructions>"
+bool chip8_profile_write_folded(const chip8_t *chip8, const char *file_name)
+{
+    const chip8_profile_t *profile = chip8->profile;
+    FILE *file = fopen(file_name, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Could not open profile file '%s' for writing!\n", file_name);
+        return false;
+    }
+
+    for (uint16_t node = 0; node < profile->node_count; node++)
+    {
+        if (profile->nodes[node].insts == 0)
+            continue;
+
+        // the path is found leaf first, print it root first
+        uint16_t path[12]; // a trie path is never deeper than the stack
+        uint8_t depth = 0;
+        for (uint16_t n = node; n != 0; n = profile->nodes[n].parent)
+            path[depth++] = profile->nodes[n].address;
+
+        fputs("main", file);
+        while (depth-- > 0)
+        {
+            if (path[depth] == PROFILE_UNKNOWN_CALL)
+                fputs(";sub_unknown", file);
+            else
+                fprintf(file, ";sub_%03X", path[depth]);
+        }
+        fprintf(file, " %llu\n", (unsigned long long)profile->nodes[node].insts);
+    }
+
+    if (fclose(file) != 0)
+    {
+        fprintf(stderr, "Could not write profile file '%s'!\n", file_name);
+        return false;
+    }
+    return true;
+}
+#else
+#define PROFILE_START(chip8)
+#define PROFILE_STOP(chip8, opcode)
+
+void chip8_profile_reset(chip8_t *chip8)
+{
+    (void)chip8;
+}
+
+bool chip8_profile_report(const chip8_t *chip8)
+{
+    (void)chip8;
+    return false;
+}
+
+bool chip8_profile_write_folded(const chip8_t *chip8, const char *file_name)
+{
+    (void)chip8;
+    (void)file_name;
+    return false;
+}
+#endif // PROFILE
+
+// emulates instructions for chip8
+static void emulate_instructions(chip8_t *chip8)
+{
+    // get the next 16-bit opcode from ram
+    chip8->inst.opcode = (chip8->ram[chip8->PC & 0xFFF] << 8) | (chip8->ram[(chip8->PC + 1) & 0xFFF]);
+    chip8->PC += 2;
+
+    // fill out registers and constants for the opcode
+    chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;
+    chip8->inst.NN = chip8->inst.opcode & 0x00FF;
+    chip8->inst.N = chip8->inst.opcode & 0x000F;
+    chip8->inst.X = (chip8->inst.opcode & 0x0F00) >> 8;
+    chip8->inst.Y = (chip8->inst.opcode & 0x00F0) >> 4;
+
+#ifdef DEBUG
+    if (chip8->trace)
+        trace_begin(chip8);
+#endif
+
+    PROFILE_START(chip8);
+
+    // emulate opcode
+    switch ((chip8->inst.opcode >> 12) & 0xF)
+    {
+    case 0x0:
+        if (chip8->inst.NN == 0xE0){ // clear screen
+            memset(&chip8->display[0], false, sizeof chip8->display);
+            chip8->dirty_rows = ~0u;
+        }
+        else if (chip8->inst.NN == 0xEE) // return from subroutine
+            chip8->PC = *--chip8->stack_ptr;
+        break;
+
+    case 0x1: // jump to address NNN
+        chip8->PC = chip8->inst.NNN;
+        break;
+
+    case 0x2: // call subroutine at NNN
+        *chip8->stack_ptr++ = chip8->PC;
+        chip8->PC = chip8->inst.NNN;
+        break;
+
+    case 0x3: // skip the next instruction if V[X] = NN
+        if (chip8->V[chip8->inst.X] == chip8->inst.NN)
+            chip8->PC += 2;
+        break;
+
+    case 0x4: // skip the next instruction if V[X] = NN
+        if (chip8->V[chip8->inst.X] != chip8->inst.NN)
+            chip8->PC += 2;
+        break;
+
+    case 0x5: // skip next instruction if V[X] = V[Y] (5XY0)
+        if ((chip8->inst.N == 0) && (chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]))
+            chip8->PC += 2;
+        break;
+
+    case 0x6: // set V[X] to NN
+        chip8->V[chip8->inst.X] = chip8->inst.NN;
+        break;
+
+    case 0x7: // add NN to V[X] (carry flag is not changed)
+        chip8->V[chip8->inst.X] += chip8->inst.NN;
+        break;
+
+    case 0x8:
+        switch (chip8->inst.N)
+        {
+        case 0x0: // set V[X] = V[Y]
+            chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
+            break;
+        case 0x1: // set V[X] |= V[Y]
+            chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
+            break;
+        case 0x2: // set V[X] &= V[Y]
+            chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
+            break;
+        case 0x3: // set V[X] ^= V[Y]
+            chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
+            break;
+        case 0x4: // set V[X] += V[Y], set V[F] to 1 if carry
+            chip8->V[0xF] =  ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255);
+            chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
+            break;
+        case 0x5: // set V[X] -= V[Y], set V[F] to 1 if no borrow
+            chip8->V[0xF] = (chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y]);
+            chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
+            break;
+        case 0x6: // stores the LSB of V[X] in V[F] and sets V[X] >>= 1
+            chip8->V[0xF] = chip8->V[chip8->inst.X] & 0x01;
+            chip8->V[chip8->inst.X] >>= 1;
+            break;
+        case 0x7: // set V[X] = V[Y] - V[X]
+            chip8->V[0xF] = chip8->V[chip8->inst.Y] >= chip8->V[chip8->inst.X];
+
+            chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
+            break;
+        case 0xE: // stores the MSB of V[X] in V[F] and sets V[X] <<= 1
+            chip8->V[0xF] = (chip8->V[chip8->inst.X] & 0x80) >> 7;
+            chip8->V[chip8->inst.X] <<= 1;
+            break;
+        default:
+            break;
+        }
+        break;
+
+    case 0x9: // skip next instruction if V[X] != V[Y] (9XY0)
+        if ((chip8->inst.N == 0) && (chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y]))
+            chip8->PC += 2;
+        break;
+
+    case 0xA: // set index reg to NNN
+        chip8->I = chip8->inst.NNN;
+        break;
+
+    case 0xB: // set PC to V[0] + NNN
+        chip8->PC = chip8->V[0x0] + chip8->inst.NNN;
+        break;
+
+    case 0xC: // set V[X] = rand(0-255) & NN
+        chip8->V[chip8->inst.X] = chip8_rng_next(&chip8->rng_state) & chip8->inst.NN;
+        break;
+
+    case 0xD: // draw N height sprites (stored at location I) at coords (V[X], V[Y])
+        draw_sprite(chip8, chip8->V[chip8->inst.X], chip8->V[chip8->inst.Y], chip8->inst.N);
+        break;
+
+    case 0xE:
+        if(chip8->inst.NN == 0x9E){ // skip next instruction if key stored in V[X] is pressed
+            if(chip8->keypad[chip8->V[chip8->inst.X] & 0xF] == true)
+                chip8->PC += 2;
+        }
+        else if(chip8->inst.NN == 0xA1){ // skip next instruction if key stored in V[X] is NOT pressed
+            if(chip8->keypad[chip8->V[chip8->inst.X] & 0xF] == false)
+                chip8->PC += 2;
+        }
+        break;
+
+    case 0xF:
+        switch(chip8->inst.NN)
+        {
+            case 0x0A: // V[X] = get_key(); Await a key press
+            {    
+                bool key_pressed = false;
+                for(uint8_t i = 0; i < sizeof chip8->keypad; i++)
+                {
+                    if(chip8->keypad[i]){
+                        chip8->V[chip8->inst.X] = i;
+                        key_pressed = true;
+                        break;
+                    }
+                }
+                if(!key_pressed)
+                    chip8->PC -= 2; // stay here until a key is pressed
+                break;
+            }
+            case 0x1E: // set I += V[X]; V[F] is not affected
+                chip8->I += chip8->V[chip8->inst.X];
+                break;
+            case 0x07: // set V[X] = delay timer
+                chip8->V[chip8->inst.X] = chip8->delay_timer;
+                break;
+            case 0x15: // set delay timer = V[X]
+                chip8->delay_timer = chip8->V[chip8->inst.X];
+                break;
+            case 0x18: // set sound timer = V[X]
+                chip8->sound_timer = chip8->V[chip8->inst.X];
+                break;
+            case 0x29: // set I to the location of sprite of character stored in V[X]
+                chip8->I = chip8->V[chip8->inst.X] * 5;
+                break;
+            case 0x33: // store BCD rep pf V[X] from index I onwards(I -> hundred's, I+1 -> ten's, I+2 -> one's)
+            {   
+                uint8_t bcd = chip8->V[chip8->inst.X];
+                for(int i = 2; i >= 0; i--){
+                    ram_write(chip8, chip8->I + i, bcd % 10);
+                    bcd /= 10;
+                }
+                break;
+            }
+            case 0x55: // store values from V[0] to V[X] in memory from index I onwards
+            {
+                for(uint8_t i = 0; i <= chip8->inst.X; i++)
+                {
+                    ram_write(chip8, chip8->I + i, chip8->V[i]);
+                }
+                break;
+            }
+            case 0x65: // store values from V[0] to V[X] in memory from index I onwards
+            {
+                for(uint8_t i = 0; i <= chip8->inst.X; i++)
+                {
+                    chip8->V[i] = chip8->ram[(chip8->I + i) & 0xFFF];
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        break;
+
+    default:
+        break; // unimplemented or invalid opcode
+    }
+
+    PROFILE_STOP(chip8, chip8->inst.opcode);
+
+#ifdef DEBUG
+    if (chip8->trace)
+        trace_end(chip8);
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// table driven dispatch: one handler per concrete opcode form, looked up by
+// the full 16-bit opcode so no nibble decoding is needed at run time
+// ---------------------------------------------------------------------------
+
+typedef void (*opcode_handler_t)(chip8_t *chip8, const instruction_t *inst);
+
+static void op_nop(chip8_t *chip8, const instruction_t *inst)
+{
+    (void)chip8;
+    (void)inst; // unimplemented or invalid opcode
+}
+
+static void op_00E0(chip8_t *chip8, const instruction_t *inst) // clear screen
+{
+    (void)inst;
+    memset(&chip8->display[0], false, sizeof chip8->display);
+    chip8->dirty_rows = ~0u;
+}
+
+static void op_00EE(chip8_t *chip8, const instruction_t *inst) // return from subroutine
+{
+    (void)inst;
+    chip8->PC = *--chip8->stack_ptr;
+}
+
+static void op_1NNN(chip8_t *chip8, const instruction_t *inst) // jump to address NNN
+{
+    chip8->PC = inst->NNN;
+}
+
+static void op_2NNN(chip8_t *chip8, const instruction_t *inst) // call subroutine at NNN
+{
+    *chip8->stack_ptr++ = chip8->PC;
+    chip8->PC = inst->NNN;
+}
+
+static void op_3XNN(chip8_t *chip8, const instruction_t *inst) // skip if V[X] == NN
+{
+    if (chip8->V[inst->X] == inst->NN)
+        chip8->PC += 2;
+}
+
+static void op_4XNN(chip8_t *chip8, const instruction_t *inst) // skip if V[X] != NN
+{
+    if (chip8->V[inst->X] != inst->NN)
+        chip8->PC += 2;
+}
+
+static void op_5XY0(chip8_t *chip8, const instruction_t *inst) // skip if V[X] == V[Y]
+{
+    if (chip8->V[inst->X] == chip8->V[inst->Y])
+        chip8->PC += 2;
+}
+
+static void op_6XNN(chip8_t *chip8, const instruction_t *inst) // set V[X] to NN
+{
+    chip8->V[inst->X] = inst->NN;
+}
+
+static void op_7XNN(chip8_t *chip8, const instruction_t *inst) // add NN to V[X] (carry flag is not changed)
+{
+    chip8->V[inst->X] += inst->NN;
+}
+
+static void op_8XY0(chip8_t *chip8, const instruction_t *inst) // set V[X] = V[Y]
+{
+    chip8->V[inst->X] = chip8->V[inst->Y];
+}
+
+static void op_8XY1(chip8_t *chip8, const instruction_t *inst) // set V[X] |= V[Y]
+{
+    chip8->V[inst->X] |= chip8->V[inst->Y];
+}
+
+static void op_8XY2(chip8_t *chip8, const instruction_t *inst) // set V[X] &= V[Y]
+{
+    chip8->V[inst->X] &= chip8->V[inst->Y];
+}
+
+static void op_8XY3(chip8_t *chip8, const instruction_t *inst) // set V[X] ^= V[Y]
+{
+    chip8->V[inst->X] ^= chip8->V[inst->Y];
+}
+
+static void op_8XY4(chip8_t *chip8, const instruction_t *inst) // set V[X] += V[Y], set V[F] to 1 if carry
+{
+    chip8->V[0xF] = ((uint16_t)(chip8->V[inst->X] + chip8->V[inst->Y]) > 255);
+    chip8->V[inst->X] += chip8->V[inst->Y];
+}
+
+static void op_8XY5(chip8_t *chip8, const instruction_t *inst) // set V[X] -= V[Y], set V[F] to 1 if no borrow
+{
+    chip8->V[0xF] = (chip8->V[inst->X] >= chip8->V[inst->Y]);
+    chip8->V[inst->X] -= chip8->V[inst->Y];
+}
+
+static void op_8XY6(chip8_t *chip8, const instruction_t *inst) // stores the LSB of V[X] in V[F] and sets V[X] >>= 1
+{
+    chip8->V[0xF] = chip8->V[inst->X] & 0x01;
+    chip8->V[inst->X] >>= 1;
+}
+
+static void op_8XY7(chip8_t *chip8, const instruction_t *inst) // set V[X] = V[Y] - V[X]
+{
+    chip8->V[0xF] = chip8->V[inst->Y] >= chip8->V[inst->X];
+    chip8->V[inst->X] = chip8->V[inst->Y] - chip8->V[inst->X];
+}
+
+static void op_8XYE(chip8_t *chip8, const instruction_t *inst) // stores the MSB of V[X] in V[F] and sets V[X] <<= 1
+{
+    chip8->V[0xF] = (chip8->V[inst->X] & 0x80) >> 7;
+    chip8->V[inst->X] <<= 1;
+}
+
+static void op_9XY0(chip8_t *chip8, const instruction_t *inst) // skip if V[X] != V[Y]
+{
+    if (chip8->V[inst->X] != chip8->V[inst->Y])
+        chip8->PC += 2;
+}
+
+static void op_ANNN(chip8_t *chip8, const instruction_t *inst) // set index reg to NNN
+{
+    chip8->I = inst->NNN;
+}
+
+static void op_BNNN(chip8_t *chip8, const instruction_t *inst) // set PC to V[0] + NNN
+{
+    chip8->PC = chip8->V[0x0] + inst->NNN;
+}
+
+static void op_CXNN(chip8_t *chip8, const instruction_t *inst) // set V[X] = rand(0-255) & NN
+{
+    chip8->V[inst->X] = chip8_rng_next(&chip8->rng_state) & inst->NN;
+}
+
+static void op_DXYN(chip8_t *chip8, const instruction_t *inst) // draw N height sprite at coords (V[X], V[Y])
+{
+    draw_sprite(chip8, chip8->V[inst->X], chip8->V[inst->Y], inst->N);
+}
+
+static void op_EX9E(chip8_t *chip8, const instruction_t *inst) // skip if key stored in V[X] is pressed
+{
+    if (chip8->keypad[chip8->V[inst->X] & 0xF] == true)
+        chip8->PC += 2;
+}
+
+static void op_EXA1(chip8_t *chip8, const instruction_t *inst) // skip if key stored in V[X] is NOT pressed
+{
+    if (chip8->keypad[chip8->V[inst->X] & 0xF] == false)
+        chip8->PC += 2;
+}
+
+static void op_FX07(chip8_t *chip8, const instruction_t *inst) // set V[X] = delay timer
+{
+    chip8->V[inst->X] = chip8->delay_timer;
+}
+
+static void op_FX0A(chip8_t *chip8, const instruction_t *inst) // V[X] = get_key(); Await a key press
+{
+    for (uint8_t i = 0; i < sizeof chip8->keypad; i++)
+    {
+        if (chip8->keypad[i])
+        {
+            chip8->V[inst->X] = i;
+            return;
+        }
+    }
+    chip8->PC -= 2; // stay here until a key is pressed
+}
+
+static void op_FX15(chip8_t *chip8, const instruction_t *inst) // set delay timer = V[X]
+{
+    chip8->delay_timer = chip8->V[inst->X];
+}
+
+static void op_FX18(chip8_t *chip8, const instruction_t *inst) // set sound timer = V[X]
+{
+    chip8->sound_timer = chip8->V[inst->X];
+}
+
+static void op_FX1E(chip8_t *chip8, const instruction_t *inst) // set I += V[X]; V[F] is not affected
+{
+    chip8->I += chip8->V[inst->X];
+}
+
+static void op_FX29(chip8_t *chip8, const instruction_t *inst) // set I to the font sprite of the character in V[X]
+{
+    chip8->I = chip8->V[inst->X] * 5;
+}
+
+static void op_FX33(chip8_t *chip8, const instruction_t *inst) // store BCD rep of V[X] from index I onwards
+{
+    uint8_t bcd = chip8->V[inst->X];
+    for (int i = 2; i >= 0; i--)
+    {
+        ram_write(chip8, chip8->I + i, bcd % 10);
+        bcd /= 10;
+    }
+}
+
+static void op_FX55(chip8_t *chip8, const instruction_t *inst) // store V[0] to V[X] in memory from index I onwards
+{
+    for (uint8_t i = 0; i <= inst->X; i++)
+        ram_write(chip8, chip8->I + i, chip8->V[i]);
+}
+
+static void op_FX65(chip8_t *chip8, const instruction_t *inst) // load V[0] to V[X] from memory from index I onwards
+{
+    for (uint8_t i = 0; i <= inst->X; i++)
+        chip8->V[i] = chip8->ram[(chip8->I + i) & 0xFFF];
+}
+
+// pick the handler for a concrete opcode; mirrors the switch in emulate_instructions
+static opcode_handler_t decode_handler(uint16_t opcode)
+{
+    const uint8_t NN = opcode & 0x00FF;
+    const uint8_t N = opcode & 0x000F;
+
+    switch ((opcode >> 12) & 0xF)
+    {
+    case 0x0:
+        if (NN == 0xE0) return op_00E0;
+        if (NN == 0xEE) return op_00EE;
+        return op_nop;
+    case 0x1: return op_1NNN;
+    case 0x2: return op_2NNN;
+    case 0x3: return op_3XNN;
+    case 0x4: return op_4XNN;
+    case 0x5: return N == 0 ? op_5XY0 : op_nop;
+    case 0x6: return op_6XNN;
+    case 0x7: return op_7XNN;
+    case 0x8:
+        switch (N)
+        {
+        case 0x0: return op_8XY0;
+        case 0x1: return op_8XY1;
+        case 0x2: return op_8XY2;
+        case 0x3: return op_8XY3;
+        case 0x4: return op_8XY4;
+        case 0x5: return op_8XY5;
+        case 0x6: return op_8XY6;
+        case 0x7: return op_8XY7;
+        case 0xE: return op_8XYE;
+        default: return op_nop;
+        }
+    case 0x9: return N == 0 ? op_9XY0 : op_nop;
+    case 0xA: return op_ANNN;
+    case 0xB: return op_BNNN;
+    case 0xC: return op_CXNN;
+    case 0xD: return op_DXYN;
+    case 0xE:
+        if (NN == 0x9E) return op_EX9E;
+        if (NN == 0xA1) return op_EXA1;
+        return op_nop;
+    case 0xF:
+        switch (NN)
+        {
+        case 0x07: return op_FX07;
+        case 0x0A: return op_FX0A;
+        case 0x15: return op_FX15;
+        case 0x18: return op_FX18;
+        case 0x1E: return op_FX1E;
+        case 0x29: return op_FX29;
+        case 0x33: return op_FX33;
+        case 0x55: return op_FX55;
+        case 0x65: return op_FX65;
+        default: return op_nop;
+        }
+    default:
+        return op_nop;
+    }
+}
+
+// two level table: a byte per opcode indexing a short handler list keeps the
+// whole table at 64 KB instead of 512 KB of pointers
+static opcode_handler_t handlers[64];
+static uint8_t dispatch_table[0x10000];
+
+// build the opcode -> handler table, only done once per process
+static void init_dispatch_table(void)
+{
+    static bool initialised = false;
+    if (initialised)
+        return;
+
+    uint8_t handler_count = 0;
+    for (uint32_t opcode = 0; opcode <= 0xFFFF; opcode++)
+    {
+        const opcode_handler_t handler = decode_handler((uint16_t)opcode);
+
+        uint8_t id = 0;
+        while (id < handler_count && handlers[id] != handler)
+            id++;
+        if (id == handler_count)
+            handlers[handler_count++] = handler;
+
+        dispatch_table[opcode] = id;
+    }
+
+    initialised = true;
+}
+
+// emulates one instruction through the dispatch table
+static inline void emulate_instruction_table(chip8_t *chip8)
+{
+    // get the next 16-bit opcode from ram
+    const uint16_t opcode = (chip8->ram[chip8->PC & 0xFFF] << 8) | (chip8->ram[(chip8->PC + 1) & 0xFFF]);
+    chip8->PC += 2;
+
+    chip8->inst.opcode = opcode;
+    chip8->inst.NNN = opcode & 0x0FFF;
+    chip8->inst.NN = opcode & 0x00FF;
+    chip8->inst.N = opcode & 0x000F;
+    chip8->inst.X = (opcode & 0x0F00) >> 8;
+    chip8->inst.Y = (opcode & 0x00F0) >> 4;
+
+#ifdef DEBUG
+    if (chip8->trace)
+        trace_begin(chip8);
+#endif
+
+    PROFILE_START(chip8);
+    handlers[dispatch_table[opcode]](chip8, &chip8->inst);
+    PROFILE_STOP(chip8, opcode);
+
+#ifdef DEBUG
+    if (chip8->trace)
+        trace_end(chip8);
+#endif
+}
+
+// decode the instruction at address into the cache entry for that address;
+// address is already within ram, a BNNN jump past its end wraps
+static void predecode(chip8_t *chip8, uint16_t address)
+{
+    decoded_inst_t *entry = &chip8->decoded[address];
+    const uint16_t opcode = (chip8->ram[address] << 8) | (chip8->ram[(address + 1) & 0xFFF]);
+
+    entry->inst.opcode = opcode;
+    entry->inst.NNN = opcode & 0x0FFF;
+    entry->inst.NN = opcode & 0x00FF;
+    entry->inst.N = opcode & 0x000F;
+    entry->inst.X = (opcode & 0x0F00) >> 8;
+    entry->inst.Y = (opcode & 0x00F0) >> 4;
+    entry->handler = dispatch_table[opcode];
+    entry->valid = true;
+}
+
+// emulates one instruction from the predecoded cache, decoding on a miss
+static inline void emulate_instruction_cached(chip8_t *chip8)
+{
+    const uint16_t address = chip8->PC & 0xFFF;
+    const decoded_inst_t *entry = &chip8->decoded[address];
+    if (!entry->valid)
+        predecode(chip8, address);
+
+    chip8->PC += 2;
+
+#ifdef DEBUG
+    chip8->inst = entry->inst;
+    if (chip8->trace)
+        trace_begin(chip8);
+#endif
+
+    // operands are read straight from the cache entry; an entry invalidated by
+    // its own store (FX33/FX55) keeps its fields until the next predecode
+    PROFILE_START(chip8);
+    handlers[entry->handler](chip8, &entry->inst);
+    PROFILE_STOP(chip8, entry->inst.opcode);
+
+#ifdef DEBUG
+    if (chip8->trace)
+        trace_end(chip8);
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// x86-64 dynamic recompiler
+//
+// Straight-line runs of chip8 code are translated into native basic blocks
+// ending at a jump, call, return, skip or an opcode the recompiler leaves to
+// the interpreter (00E0, CXNN, DXYN, EX9E/EXA1, FX0A, FX33/55/65). Generated
+// code keeps chip8_t in rbx and the jit_t in r12 and works on the registers
+// in place. Blocks chain to each other through jit->blocks, so dropping a
+// table entry is all it takes to invalidate one.
+// ---------------------------------------------------------------------------
+
+#ifdef CHIP8_JIT
+
+#define JIT_BUFFER_SIZE (4 * 1024 * 1024)
+#define JIT_MAX_BLOCK_INSTS 32
+#define JIT_MAX_BLOCK_CODE 4096 // upper bound of native bytes for one block
+
+typedef void (*jit_entry_t)(chip8_t *chip8, jit_t *jit, const uint8_t *block);
+
+struct jit_t
+{
+    int32_t budget;                 // instructions, or with cycle costs cycles, left in the current run
+    int32_t call_extra;             // cycles a call or return costs beyond one: 1 with cycle costs, else 0
+    uint32_t extra_cycles;          // cycles charged beyond one per instruction in the current run
+    const uint8_t *blocks[4096];    // native block per chip8 address, NULL if none
+    uint8_t block_bytes[4096];      // chip8 code bytes covered by each block
+    bool uncompilable[4096];        // address starts with an interpreter only opcode
+    bool code[4096];                // ram byte is covered by at least one block
+    uint8_t *buffer;                // executable code buffer
+    size_t used;                    // bytes of the buffer in use
+    size_t stubs_size;              // entry/exit stubs at the start of the buffer
+    jit_entry_t enter;              // saves host registers and jumps into a block
+    const uint8_t *exit_stub;       // restores host registers and returns
+    uint64_t blocks_compiled;
+    uint64_t invalidations;
+};
+
+#define OFF_V(x) ((uint32_t)(offsetof(chip8_t, V) + (x)))
+#define OFF_I ((uint32_t)offsetof(chip8_t, I))
+#define OFF_PC ((uint32_t)offsetof(chip8_t, PC))
+#define OFF_SP ((uint32_t)offsetof(chip8_t, stack_ptr))
+#define OFF_DT ((uint32_t)offsetof(chip8_t, delay_timer))
+#define OFF_ST ((uint32_t)offsetof(chip8_t, sound_timer))
+#define OFF_BUDGET ((uint32_t)offsetof(jit_t, budget))
+#define OFF_CALL_EXTRA ((uint32_t)offsetof(jit_t, call_extra))
+#define OFF_EXTRA_CYCLES ((uint32_t)offsetof(jit_t, extra_cycles))
+#define OFF_BLOCKS ((uint32_t)offsetof(jit_t, blocks))
+
+static void emit8(jit_t *jit, uint8_t byte)
+{
+    jit->buffer[jit->used++] = byte;
+}
+
+static void emit16(jit_t *jit, uint16_t value)
+{
+    emit8(jit, value & 0xFF);
+    emit8(jit, value >> 8);
+}
+
+static void emit32(jit_t *jit, uint32_t value)
+{
+    emit16(jit, value & 0xFFFF);
+    emit16(jit, value >> 16);
+}
+
+// <opcode> reg, [rbx + disp32]; reg is the modrm reg field (register or /digit)
+static void emit_rbx(jit_t *jit, uint8_t opcode, uint8_t reg, uint32_t disp)
+{
+    emit8(jit, opcode);
+    emit8(jit, 0x83 | (reg << 3));
+    emit32(jit, disp);
+}
+
+// jcc/jmp rel32 to a known target
+static void emit_jump(jit_t *jit, uint8_t cond, const uint8_t *target)
+{
+    if (cond)
+    {
+        emit8(jit, 0x0F);
+        emit8(jit, cond);
+    }
+    else
+        emit8(jit, 0xE9);
+    emit32(jit, (uint32_t)(target - (jit->buffer + jit->used + 4)));
+}
+
+// jcc rel32 to a label emitted later, returns the offset to patch
+static size_t emit_jump_forward(jit_t *jit, uint8_t cond)
+{
+    emit8(jit, 0x0F);
+    emit8(jit, cond);
+    emit32(jit, 0);
+    return jit->used;
+}
+
+static void patch_jump(jit_t *jit, size_t from)
+{
+    const uint32_t rel = (uint32_t)(jit->used - from);
+    memcpy(&jit->buffer[from - 4], &rel, sizeof rel);
+}
+
+#define JCC_JE 0x84
+#define JCC_JNE 0x85
+#define JCC_JA 0x87
+#define JCC_JL 0x8C
+
+// leave the block at a constant chip8 address, chaining into its block if compiled
+static void emit_exit_static(jit_t *jit, uint32_t target)
+{
+    emit8(jit, 0x66); emit_rbx(jit, 0xC7, 0, OFF_PC); emit16(jit, (uint16_t)target); // mov word [rbx+PC], target
+
+    if (target > 0xFFE)
+    {
+        emit_jump(jit, 0, jit->exit_stub);
+        return;
+    }
+
+    emit8(jit, 0x49); emit8(jit, 0x8B); emit8(jit, 0x84); emit8(jit, 0x24); // mov rax, [r12+blocks+target*8]
+    emit32(jit, OFF_BLOCKS + target * (uint32_t)sizeof(jit->blocks[0]));
+    emit8(jit, 0x48); emit8(jit, 0x85); emit8(jit, 0xC0);                   // test rax, rax
+    emit_jump(jit, JCC_JE, jit->exit_stub);
+    emit8(jit, 0xFF); emit8(jit, 0xE0);                                     // jmp rax
+}
+
+// leave the block at the address in ecx (already stored to PC)
+static void emit_exit_dynamic(jit_t *jit)
+{
+    emit8(jit, 0x81); emit8(jit, 0xF9); emit32(jit, 0xFFE);               // cmp ecx, 0xFFE
+    emit_jump(jit, JCC_JA, jit->exit_stub);
+    emit8(jit, 0x49); emit8(jit, 0x8B); emit8(jit, 0x84); emit8(jit, 0xCC); // mov rax, [r12+rcx*8+blocks]
+    emit32(jit, OFF_BLOCKS);
+    emit8(jit, 0x48); emit8(jit, 0x85); emit8(jit, 0xC0);                   // test rax, rax
+    emit_jump(jit, JCC_JE, jit->exit_stub);
+    emit8(jit, 0xFF); emit8(jit, 0xE0);                                     // jmp rax
+}
+
+// skip opcodes: compare already emitted, cond jumps to the skipping exit
+static void emit_skip(jit_t *jit, uint8_t cond, uint32_t next_pc)
+{
+    const size_t taken = emit_jump_forward(jit, cond);
+    emit_exit_static(jit, next_pc);
+    patch_jump(jit, taken);
+    emit_exit_static(jit, next_pc + 2);
+}
+
+// calls and returns are the only compiled opcodes costing more than a cycle
+// and they end their block, so the budget check at block entry holds for
+// cycles too; the second cycle comes out of the budget here, when charged
+static void emit_call_cost(jit_t *jit)
+{
+    emit8(jit, 0x41); emit8(jit, 0x8B); emit8(jit, 0x84); emit8(jit, 0x24); // mov eax, [r12+call_extra]
+    emit32(jit, OFF_CALL_EXTRA);
+    emit8(jit, 0x41); emit8(jit, 0x29); emit8(jit, 0x84); emit8(jit, 0x24); // sub [r12+budget], eax
+    emit32(jit, OFF_BUDGET);
+    emit8(jit, 0x41); emit8(jit, 0x01); emit8(jit, 0x84); emit8(jit, 0x24); // add [r12+extra_cycles], eax
+    emit32(jit, OFF_EXTRA_CYCLES);
+}
+
+// mov al, [rbx+V[a]]; <op> al, [rbx+V[b]] ...
+static void emit_load_al(jit_t *jit, uint8_t x) { emit_rbx(jit, 0x8A, 0, OFF_V(x)); }
+static void emit_store_al(jit_t *jit, uint8_t x) { emit_rbx(jit, 0x88, 0, OFF_V(x)); }
+
+// translate one instruction; returns false if it must be left to the interpreter
+// and sets *ends_block when it transfers control
+static bool jit_emit_instruction(jit_t *jit, uint16_t opcode, uint32_t pc, bool *ends_block)
+{
+    const uint8_t X = (opcode >> 8) & 0xF;
+    const uint8_t Y = (opcode >> 4) & 0xF;
+    const uint8_t N = opcode & 0xF;
+    const uint8_t NN = opcode & 0xFF;
+    const uint16_t NNN = opcode & 0xFFF;
+    const uint32_t next_pc = pc + 2;
+
+    *ends_block = false;
+
+    switch (opcode >> 12)
+    {
+    case 0x0:
+        if (NN == 0xEE) // return from subroutine
+        {
+            emit_call_cost(jit);
+            emit8(jit, 0x48); emit_rbx(jit, 0x8B, 0, OFF_SP);               // mov rax, [rbx+stack_ptr]
+            emit8(jit, 0x48); emit8(jit, 0x83); emit8(jit, 0xE8); emit8(jit, 0x02); // sub rax, 2
+            emit8(jit, 0x48); emit_rbx(jit, 0x89, 0, OFF_SP);               // mov [rbx+stack_ptr], rax
+            emit8(jit, 0x0F); emit8(jit, 0xB7); emit8(jit, 0x08);           // movzx ecx, word [rax]
+            emit8(jit, 0x66); emit_rbx(jit, 0x89, 1, OFF_PC);               // mov [rbx+PC], cx
+            emit_exit_dynamic(jit);
+            *ends_block = true;
+            return true;
+        }
+        return NN != 0xE0; // 00E0 is interpreted, other 0NNN are no-ops
+
+    case 0x1: // jump to address NNN
+        emit_exit_static(jit, NNN);
+        *ends_block = true;
+        return true;
+
+    case 0x2: // call subroutine at NNN
+        emit_call_cost(jit);
+        emit8(jit, 0x48); emit_rbx(jit, 0x8B, 0, OFF_SP);                   // mov rax, [rbx+stack_ptr]
+        emit8(jit, 0x66); emit8(jit, 0xC7); emit8(jit, 0x00); emit16(jit, (uint16_t)next_pc); // mov word [rax], next_pc
+        emit8(jit, 0x48); emit_rbx(jit, 0x83, 0, OFF_SP); emit8(jit, 0x02); // add qword [rbx+stack_ptr], 2
+        emit_exit_static(jit, NNN);
+        *ends_block = true;
+        return true;
+
+    case 0x3: // skip if V[X] == NN
+    case 0x4: // skip if V[X] != NN
+        emit_rbx(jit, 0x80, 7, OFF_V(X)); emit8(jit, NN);                   // cmp byte [rbx+V[X]], NN
+        emit_skip(jit, (opcode >> 12) == 0x3 ? JCC_JE : JCC_JNE, next_pc);
+        *ends_block = true;
+        return true;
+
+    case 0x5: // skip if V[X] == V[Y]
+    case 0x9: // skip if V[X] != V[Y]
+        if (N != 0)
+            return true; // no-op
+        emit_load_al(jit, X);
+        emit_rbx(jit, 0x3A, 0, OFF_V(Y));                                   // cmp al, [rbx+V[Y]]
+        emit_skip(jit, (opcode >> 12) == 0x5 ? JCC_JE : JCC_JNE, next_pc);
+        *ends_block = true;
+        return true;
+
+    case 0x6: // set V[X] to NN
+        emit_rbx(jit, 0xC6, 0, OFF_V(X)); emit8(jit, NN);
+        return true;
+
+    case 0x7: // add NN to V[X]
+        emit_rbx(jit, 0x80, 0, OFF_V(X)); emit8(jit, NN);
+        return true;
+
+    case 0x8:
+        // flag writes happen before the result, exactly as the interpreter does,
+        // so X or Y == F behaves identically
+        switch (N)
+        {
+        case 0x0:
+            emit_rbx(jit, 0x8A, 0, OFF_V(Y));
+            emit_store_al(jit, X);
+            return true;
+        case 0x1:
+        case 0x2:
+        case 0x3:
+        {
+            const uint8_t alu[] = {0, 0x08, 0x20, 0x30}; // or, and, xor [mem], al
+            emit_rbx(jit, 0x8A, 0, OFF_V(Y));
+            emit_rbx(jit, alu[N], 0, OFF_V(X));
+            return true;
+        }
+        case 0x4: // V[F] = carry; V[X] += V[Y]
+            emit_load_al(jit, X);
+            emit_rbx(jit, 0x02, 0, OFF_V(Y));                               // add al, [rbx+V[Y]]
+            emit8(jit, 0x0F); emit8(jit, 0x92); emit8(jit, 0xC1);           // setc cl
+            emit_rbx(jit, 0x88, 1, OFF_V(0xF));
+            emit_load_al(jit, X);
+            emit_rbx(jit, 0x02, 0, OFF_V(Y));
+            emit_store_al(jit, X);
+            return true;
+        case 0x5: // V[F] = V[X] >= V[Y]; V[X] -= V[Y]
+        case 0x7: // V[F] = V[Y] >= V[X]; V[X] = V[Y] - V[X]
+        {
+            const uint8_t a = N == 0x5 ? X : Y;
+            const uint8_t b = N == 0x5 ? Y : X;
+            emit_load_al(jit, a);
+            emit_rbx(jit, 0x3A, 0, OFF_V(b));                               // cmp al, [rbx+V[b]]
+            emit8(jit, 0x0F); emit8(jit, 0x93); emit8(jit, 0xC1);           // setae cl
+            emit_rbx(jit, 0x88, 1, OFF_V(0xF));
+            emit_load_al(jit, a);
+            emit_rbx(jit, 0x2A, 0, OFF_V(b));                               // sub al, [rbx+V[b]]
+            emit_store_al(jit, X);
+            return true;
+        }
+        case 0x6: // V[F] = V[X] & 1; V[X] >>= 1
+            emit_load_al(jit, X);
+            emit8(jit, 0x24); emit8(jit, 0x01);                             // and al, 1
+            emit_store_al(jit, 0xF);
+            emit_rbx(jit, 0xD0, 5, OFF_V(X));                               // shr byte [rbx+V[X]], 1
+            return true;
+        case 0xE: // V[F] = V[X] >> 7; V[X] <<= 1
+            emit_load_al(jit, X);
+            emit8(jit, 0xC0); emit8(jit, 0xE8); emit8(jit, 0x07);           // shr al, 7
+            emit_store_al(jit, 0xF);
+            emit_rbx(jit, 0xD0, 4, OFF_V(X));                               // shl byte [rbx+V[X]], 1
+            return true;
+        default:
+            return true; // no-op
+        }
+
+    case 0xA: // set I to NNN
+        emit8(jit, 0x66); emit_rbx(jit, 0xC7, 0, OFF_I); emit16(jit, NNN);
+        return true;
+
+    case 0xB: // jump to V[0] + NNN
+        emit8(jit, 0x0F); emit_rbx(jit, 0xB6, 1, OFF_V(0));                 // movzx ecx, byte [rbx+V[0]]
+        emit8(jit, 0x81); emit8(jit, 0xC1); emit32(jit, NNN);               // add ecx, NNN
+        emit8(jit, 0x66); emit_rbx(jit, 0x89, 1, OFF_PC);                   // mov [rbx+PC], cx
+        emit_exit_dynamic(jit);
+        *ends_block = true;
+        return true;
+
+    case 0xF:
+        switch (NN)
+        {
+        case 0x07: // V[X] = delay timer
+            emit_rbx(jit, 0x8A, 0, OFF_DT);
+            emit_store_al(jit, X);
+            return true;
+        case 0x15: // delay timer = V[X]
+            emit_load_al(jit, X);
+            emit_rbx(jit, 0x88, 0, OFF_DT);
+            return true;
+        case 0x18: // sound timer = V[X]
+            emit_load_al(jit, X);
+            emit_rbx(jit, 0x88, 0, OFF_ST);
+            return true;
+        case 0x1E: // I += V[X]
+            emit8(jit, 0x0F); emit_rbx(jit, 0xB6, 0, OFF_V(X));             // movzx eax, byte [rbx+V[X]]
+            emit8(jit, 0x66); emit_rbx(jit, 0x01, 0, OFF_I);                // add [rbx+I], ax
+            return true;
+        case 0x29: // I = V[X] * 5
+            emit8(jit, 0x0F); emit_rbx(jit, 0xB6, 0, OFF_V(X));             // movzx eax, byte [rbx+V[X]]
+            emit8(jit, 0x8D); emit8(jit, 0x04); emit8(jit, 0x80);           // lea eax, [rax+rax*4]
+            emit8(jit, 0x66); emit_rbx(jit, 0x89, 0, OFF_I);                // mov [rbx+I], ax
+            return true;
+        case 0x0A:
+        case 0x33:
+        case 0x55:
+        case 0x65:
+            return false;
+        default:
+            return true; // no-op
+        }
+
+    case 0xE:
+        return NN != 0x9E && NN != 0xA1; // key skips are interpreted, the rest are no-ops
+
+    default: // CXNN, DXYN
+        return false;
+    }
+}
+
+static void jit_flush(jit_t *jit);
+
+// translate the block starting at pc, NULL if its first opcode is interpreter only
+static const uint8_t *jit_compile(chip8_t *chip8, jit_t *jit, uint32_t pc)
+{
+    if (jit->used + JIT_MAX_BLOCK_CODE > JIT_BUFFER_SIZE)
+        jit_flush(jit);
+
+    const size_t start = jit->used;
+    const uint32_t start_pc = pc;
+    uint8_t insts = 0;
+
+    // budget check, patched with the final instruction count
+    emit8(jit, 0x41); emit8(jit, 0x83); emit8(jit, 0xAC); emit8(jit, 0x24); // sub dword [r12+budget], insts
+    emit32(jit, OFF_BUDGET);
+    emit8(jit, 0);
+    const size_t insts_patch = jit->used - 1;
+    const size_t bail = emit_jump_forward(jit, JCC_JL);
+
+    bool ends_block = false;
+    while (!ends_block && insts < JIT_MAX_BLOCK_INSTS && pc < 0xFFF)
+    {
+        const uint16_t opcode = (chip8->ram[pc] << 8) | chip8->ram[pc + 1];
+        const size_t before = jit->used;
+
+        if (!jit_emit_instruction(jit, opcode, pc, &ends_block))
+        {
+            jit->used = before;
+            break;
+        }
+
+        insts++;
+        pc += 2;
+    }
+
+    if (insts == 0)
+    {
+        jit->used = start;
+        jit->uncompilable[start_pc] = true;
+        return NULL;
+    }
+
+    if (!ends_block)
+        emit_exit_static(jit, pc); // fall through to the next block
+
+    // not enough budget left: restore it and hand the block to the interpreter
+    jit->buffer[insts_patch] = insts;
+    patch_jump(jit, bail);
+    emit8(jit, 0x41); emit8(jit, 0x83); emit8(jit, 0x84); emit8(jit, 0x24); // add dword [r12+budget], insts
+    emit32(jit, OFF_BUDGET);
+    emit8(jit, insts);
+    emit8(jit, 0x66); emit_rbx(jit, 0xC7, 0, OFF_PC); emit16(jit, (uint16_t)start_pc);
+    emit_jump(jit, 0, jit->exit_stub);
+
+    const uint32_t bytes = pc - start_pc;
+    for (uint32_t i = 0; i < bytes; i++)
+        jit->code[start_pc + i] = true;
+
+    jit->block_bytes[start_pc] = (uint8_t)bytes;
+    jit->blocks[start_pc] = &jit->buffer[start];
+    jit->blocks_compiled++;
+
+    return jit->blocks[start_pc];
+}
+
+// drop every block and start filling the code buffer again after the stubs
+static void jit_flush(jit_t *jit)
+{
+    memset(jit->blocks, 0, sizeof jit->blocks);
+    memset(jit->uncompilable, false, sizeof jit->uncompilable);
+    memset(jit->code, false, sizeof jit->code);
+    jit->used = jit->stubs_size;
+}
+
+// drop the blocks overlapping a ram byte that was just written
+static void jit_invalidate(jit_t *jit, uint16_t address)
+{
+    address &= 0xFFF;
+    jit->uncompilable[address] = false;
+    jit->uncompilable[(address - 1) & 0xFFF] = false;
+
+    if (!jit->code[address])
+        return;
+
+    const uint32_t first = address >= 2 * JIT_MAX_BLOCK_INSTS ? address - 2 * JIT_MAX_BLOCK_INSTS : 0;
+    for (uint32_t start = first; start <= address; start++)
+    {
+        if (jit->blocks[start] && start + jit->block_bytes[start] > address)
+        {
+            jit->blocks[start] = NULL;
+            jit->invalidations++;
+        }
+    }
+    jit->code[address] = false;
+}
+
+// allocate the recompiler state and its executable buffer
+static jit_t *jit_create(void)
+{
+    jit_t *jit = (jit_t *)calloc(1, sizeof(jit_t));
+    if (!jit)
+        return NULL;
+
+#ifdef _WIN32
+    jit->buffer = (uint8_t *)VirtualAlloc(NULL, JIT_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    jit->buffer = (uint8_t *)mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED)
+        jit->buffer = NULL;
+#endif
+    if (!jit->buffer)
+    {
+        free(jit);
+        return NULL;
+    }
+
+    // entry: save callee saved registers, load chip8_t/jit_t and jump to the block
+    jit->enter = (jit_entry_t)(void *)jit->buffer;
+    emit8(jit, 0x53);                                       // push rbx
+    emit8(jit, 0x41); emit8(jit, 0x54);                     // push r12
+    emit8(jit, 0x48); emit8(jit, 0x83); emit8(jit, 0xEC); emit8(jit, 0x08); // sub rsp, 8
+#ifdef _WIN32
+    emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xCB);   // mov rbx, rcx
+    emit8(jit, 0x49); emit8(jit, 0x89); emit8(jit, 0xD4);   // mov r12, rdx
+    emit8(jit, 0x41); emit8(jit, 0xFF); emit8(jit, 0xE0);   // jmp r8
+#else
+    emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xFB);   // mov rbx, rdi
+    emit8(jit, 0x49); emit8(jit, 0x89); emit8(jit, 0xF4);   // mov r12, rsi
+    emit8(jit, 0xFF); emit8(jit, 0xE2);                     // jmp rdx
+#endif
+
+    // exit: every block leaves through here with PC already stored
+    jit->exit_stub = &jit->buffer[jit->used];
+    emit8(jit, 0x48); emit8(jit, 0x83); emit8(jit, 0xC4); emit8(jit, 0x08); // add rsp, 8
+    emit8(jit, 0x41); emit8(jit, 0x5C);                     // pop r12
+    emit8(jit, 0x5B);                                       // pop rbx
+    emit8(jit, 0xC3);                                       // ret
+
+    jit->stubs_size = jit->used;
+    return jit;
+}
+
+// release the recompiler attached to an instance
+static void jit_destroy(chip8_t *chip8)
+{
+    if (!chip8->jit)
+        return;
+
+#ifdef _WIN32
+    VirtualFree(chip8->jit->buffer, 0, MEM_RELEASE);
+#else
+    munmap(chip8->jit->buffer, JIT_BUFFER_SIZE);
+#endif
+    free(chip8->jit);
+    chip8->jit = NULL;
+}
+
+// run native blocks where possible until the budget is spent; the last
+// instruction may take it below zero when cycles are charged
+static void jit_run_budget(chip8_t *chip8, jit_t *jit)
+{
+    while (jit->budget > 0)
+    {
+        const uint16_t pc = chip8->PC;
+        const int32_t budget = jit->budget;
+
+        if (pc < 0xFFF && !jit->uncompilable[pc])
+        {
+            const uint8_t *block = jit->blocks[pc];
+            if (!block)
+                block = jit_compile(chip8, jit, pc);
+
+            if (block)
+            {
+                jit->enter(chip8, jit, block);
+                if (jit->budget != budget)
+                    continue;
+            }
+        }
+
+        // interpreter only opcode, or a block longer than the budget left
+        if (jit->call_extra)
+        {
+            const uint16_t opcode = (chip8->ram[pc & 0xFFF] << 8) | chip8->ram[(pc + 1) & 0xFFF];
+            const int32_t cost = (int32_t)cycle_cost(opcode);
+            emulate_instruction_cached(chip8);
+            jit->budget -= cost;
+            jit->extra_cycles += cost - 1;
+        }
+        else
+        {
+            emulate_instruction_cached(chip8);
+            jit->budget--;
+        }
+    }
+}
+
+// run count instructions, in native blocks where possible
+static void run_jit(chip8_t *chip8, uint32_t count)
+{
+    if (!chip8->jit && !(chip8->jit = jit_create()))
+    {
+        for (uint32_t i = 0; i < count; i++)
+            emulate_instruction_cached(chip8);
+        return;
+    }
+
+    jit_t *jit = chip8->jit;
+    jit->budget = (int32_t)count;
+    jit_run_budget(chip8, jit);
+}
+
+// run to a cycle deadline with cycle costs, in native blocks where possible;
+// returns the instructions run
+static uint64_t run_jit_cycles(chip8_t *chip8, uint64_t deadline)
+{
+    if (!chip8->jit && !(chip8->jit = jit_create()))
+        return run_interpreted_cycles(chip8, BACKEND_CACHED, deadline);
+
+    jit_t *jit = chip8->jit;
+    jit->call_extra = 1;
+    uint64_t insts = 0;
+    while (chip8->cycles < deadline)
+    {
+        const uint64_t left = deadline - chip8->cycles;
+        const int32_t budget = left < INT32_MAX / 2 ? (int32_t)left : INT32_MAX / 2;
+        jit->budget = budget;
+        jit->extra_cycles = 0;
+        jit_run_budget(chip8, jit);
+
+        const uint64_t cycles = (uint64_t)((int64_t)budget - jit->budget);
+        chip8->cycles += cycles;
+        insts += cycles - jit->extra_cycles;
+    }
+    jit->call_extra = 0;
+    return insts;
+}
+
+#else
+
+static void jit_flush(jit_t *jit)
+{
+    (void)jit;
+}
+
+static void jit_invalidate(jit_t *jit, uint16_t address)
+{
+    (void)jit;
+    (void)address;
+}
+
+static void jit_destroy(chip8_t *chip8)
+{
+    (void)chip8;
+}
+
+#endif // CHIP8_JIT
+
+// ---------------------------------------------------------------------------
+// ahead-of-time recompiled rom, built in with -DAOT_ROM="<file>" (see tools/ch8c.c)
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+    uint16_t start; // chip8 address of the block
+    uint16_t bytes; // chip8 code bytes it covers
+    uint16_t insts; // instructions it executes
+    uint16_t cycles; // cycles they cost with cycle costs
+    void (*run)(chip8_t *chip8);
+} aot_block_t;
+
+#ifdef AOT_ROM
+#include AOT_ROM
+
+static const aot_block_t *aot_lookup[4096];
+
+// true if any byte in [address, address + bytes) was stored to since the rom was loaded
+static bool ram_range_written(const chip8_t *chip8, uint16_t address, uint16_t bytes)
+{
+    for (uint32_t a = address; a < (uint32_t)address + bytes; a++)
+    {
+        if (chip8->ram_written[a / 64] & (1ull << (a % 64)))
+            return true;
+    }
+    return false;
+}
+
+// index the compiled blocks by address, only done once per process
+static void init_aot(void)
+{
+    for (size_t i = 0; i < sizeof aot_blocks / sizeof aot_blocks[0]; i++)
+        aot_lookup[aot_blocks[i].start] = &aot_blocks[i];
+}
+
+// the compiled blocks are only valid for the rom they were generated from
+bool chip8_aot_matches_rom(const chip8_t *chip8)
+{
+    return memcmp(&chip8->ram[0x200], aot_rom_image, sizeof aot_rom_image) == 0;
+}
+
+// run count instructions, in compiled blocks where possible
+static void run_aot(chip8_t *chip8, uint32_t count)
+{
+    while (count > 0)
+    {
+        const aot_block_t *block = chip8->PC < 4096 ? aot_lookup[chip8->PC] : NULL;
+
+        if (block && block->insts <= count && !ram_range_written(chip8, block->start, block->bytes))
+        {
+            block->run(chip8);
+            count -= block->insts;
+        }
+        else
+        {
+            // computed jump target, self-modified code or not enough budget left
+            emulate_instruction_cached(chip8);
+            count--;
+        }
+    }
+}
+
+// run to a cycle deadline with cycle costs, in compiled blocks that fit the
+// cycles left; returns the instructions run
+static uint64_t run_aot_cycles(chip8_t *chip8, uint64_t deadline)
+{
+    uint64_t insts = 0;
+    while (chip8->cycles < deadline)
+    {
+        const aot_block_t *block = chip8->PC < 4096 ? aot_lookup[chip8->PC] : NULL;
+
+        if (block && block->cycles <= deadline - chip8->cycles && !ram_range_written(chip8, block->start, block->bytes))
+        {
+            block->run(chip8);
+            chip8->cycles += block->cycles;
+            insts += block->insts;
+        }
+        else
+        {
+            const uint16_t opcode = (chip8->ram[chip8->PC & 0xFFF] << 8) | chip8->ram[(chip8->PC + 1) & 0xFFF];
+            emulate_instruction_cached(chip8);
+            chip8->cycles += cycle_cost(opcode);
+            insts++;
+        }
+    }
+    return insts;
+}
+#else
+static void init_aot(void)
+{
+}
+
+bool chip8_aot_matches_rom(const chip8_t *chip8)
+{
+    (void)chip8;
+    return false;
+}
+#endif // AOT_ROM
+
+// run a batch of instructions on the configured backend
+static void run_backend(chip8_t *chip8, backend_t backend, uint32_t count)
+{
+    switch (backend)
+    {
+    case BACKEND_TABLE:
+        for (uint32_t i = 0; i < count; i++)
+            emulate_instruction_table(chip8);
+        break;
+
+    case BACKEND_AOT:
+#ifdef AOT_ROM
+        run_aot(chip8, count);
+#else
+        // without recompiled blocks aot means the interpreter, as everywhere
+        // else, even when a movie names it
+        for (uint32_t i = 0; i < count; i++)
+            emulate_instruction_cached(chip8);
+#endif
+        break;
+
+    case BACKEND_JIT:
+#ifdef CHIP8_JIT
+        run_jit(chip8, count);
+        break;
+#endif
+    case BACKEND_CACHED:
+        for (uint32_t i = 0; i < count; i++)
+            emulate_instruction_cached(chip8);
+        break;
+
+    case BACKEND_SWITCH:
+    default:
+        for (uint32_t i = 0; i < count; i++)
+            emulate_instructions(chip8);
+        break;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// idle loop detection: code that can only spin until the timers tick or the
+// keypad changes, both of which happen between frames, gets the rest of the
+// frame's budget skipped. After one pass such a loop leaves the machine as
+// it found it, so only whole passes are skipped and the leftover
+// instructions still run: every frame ends in the state it would have
+// reached without skipping
+// ---------------------------------------------------------------------------
+
+// instructions run between idle checks, prime so short loops line up with a check
+#define IDLE_CHECK_INTERVAL 61
+
+// length of the loop starting at PC if it cannot exit before the next
+// frame, 0 if there is none
+static uint32_t idle_loop_at(const chip8_t *chip8)
+{
+    const uint16_t pc = chip8->PC;
+    if (pc > 0xFFA)
+        return 0;
+
+    const uint16_t op0 = (chip8->ram[pc] << 8) | chip8->ram[pc + 1];
+    const uint16_t op1 = (chip8->ram[pc + 2] << 8) | chip8->ram[pc + 3];
+    const uint16_t op2 = (chip8->ram[pc + 4] << 8) | chip8->ram[pc + 5];
+    const uint8_t X = (op0 >> 8) & 0xF;
+
+    // 1NNN jumping to itself
+    if (op0 == (0x1000 | pc))
+        return 1;
+
+    // FX0A with no key down
+    if ((op0 & 0xF0FF) == 0xF00A)
+    {
+        for (uint8_t i = 0; i < sizeof chip8->keypad; i++)
+        {
+            if (chip8->keypad[i])
+                return 0;
+        }
+        return 1;
+    }
+
+    // EX9E/EXA1 followed by a jump back to it, waiting on a key
+    if (((op0 & 0xF0FF) == 0xE09E || (op0 & 0xF0FF) == 0xE0A1) && op1 == (0x1000 | pc))
+    {
+        const bool pressed = chip8->keypad[chip8->V[X] & 0xF];
+        return ((op0 & 0xFF) == 0x9E ? !pressed : pressed) ? 2 : 0;
+    }
+
+    // FX07, 3XNN/4XNN on the same register, 1NNN back to the FX07: polls the delay timer
+    if ((op0 & 0xF0FF) == 0xF007 && op2 == (0x1000 | pc) && ((op1 >> 12) == 0x3 || (op1 >> 12) == 0x4) && ((op1 >> 8) & 0xF) == X)
+    {
+        const bool equal = chip8->delay_timer == (op1 & 0xFF);
+        return ((op1 >> 12) == 0x3 ? !equal : equal) ? 3 : 0;
+    }
+
+    return 0;
+}
+
+// run count instructions, fast-forwarding idle loops when enabled
+void chip8_run(chip8_t *chip8, const core_config_t *config, uint32_t count)
+{
+    if (!config->idle_skip)
+    {
+        run_backend(chip8, config->backend, count);
+        return;
+    }
+
+    while (count > 0)
+    {
+        // one real pass, then skip the whole passes left and run the rest
+        const uint32_t length = idle_loop_at(chip8);
+        if (length > 0 && count >= 2 * length)
+        {
+            const uint32_t skipped = (count - length) / length * length;
+            run_backend(chip8, config->backend, length);
+            chip8->idle_skipped += skipped;
+            run_backend(chip8, config->backend, count - length - skipped);
+            return;
+        }
+
+        const uint32_t slice = count < IDLE_CHECK_INTERVAL ? count : IDLE_CHECK_INTERVAL;
+        run_backend(chip8, config->backend, slice);
+        count -= slice;
+    }
+}
+
+// cycles charged for an instruction when cycle costs are on: one for most,
+// more for those that walk the stack, many ram bytes or the display. These
+// are relative weights, not the timing of any one machine
+static uint32_t cycle_cost(uint16_t opcode)
+{
+    switch (opcode >> 12)
+    {
+    case 0x0:
+        return opcode == 0x00E0 ? 8 : opcode == 0x00EE ? 2 : 1;
+    case 0x2:
+        return 2;
+    case 0xD:
+        return 2 + (opcode & 0xF);
+    case 0xF:
+        if ((opcode & 0xFF) == 0x33)
+            return 3;
+        if ((opcode & 0xFF) == 0x55 || (opcode & 0xFF) == 0x65)
+            return 2 + ((opcode >> 8) & 0xF) / 2;
+        return 1;
+    default:
+        return 1;
+    }
+}
+
+// run to a cycle deadline with cycle costs one instruction at a time, as the
+// cost is only known per opcode; one started before the deadline runs whole
+static uint64_t run_interpreted_cycles(chip8_t *chip8, backend_t backend, uint64_t deadline)
+{
+    uint64_t insts = 0;
+    while (chip8->cycles < deadline)
+    {
+        const uint16_t opcode = (chip8->ram[chip8->PC & 0xFFF] << 8) | chip8->ram[(chip8->PC + 1) & 0xFFF];
+        run_backend(chip8, backend, 1);
+        chip8->cycles += cycle_cost(opcode);
+        insts++;
+    }
+    return insts;
+}
+
+// run to a cycle deadline with cycle costs on the configured backend; the
+// recompilers run whole blocks, the costs of which are known when compiled
+static uint64_t run_backend_cycles(chip8_t *chip8, backend_t backend, uint64_t deadline)
+{
+#ifdef AOT_ROM
+    if (backend == BACKEND_AOT)
+        return run_aot_cycles(chip8, deadline);
+#endif
+#ifdef CHIP8_JIT
+    if (backend == BACKEND_JIT)
+        return run_jit_cycles(chip8, deadline);
+#endif
+    return run_interpreted_cycles(chip8, backend, deadline);
+}
+
+// run until chip8->cycles reaches deadline, returning the instructions run
+// with idle skipped ones counted at one per cycle
+uint64_t chip8_run_cycles(chip8_t *chip8, const core_config_t *config, uint64_t deadline)
+{
+    if (chip8->cycles >= deadline)
+        return 0;
+
+    // one cycle per instruction: the whole budget in as few runs as possible
+    if (!config->cycle_costs)
+    {
+        const uint64_t insts = deadline - chip8->cycles;
+        for (uint64_t left = insts; left > 0;)
+        {
+            const uint32_t count = left < UINT32_MAX ? (uint32_t)left : UINT32_MAX;
+            chip8_run(chip8, config, count);
+            left -= count;
+        }
+        chip8->cycles = deadline;
+        return insts;
+    }
+
+    // an instruction started before the deadline runs whole and the next
+    // run starts that much later
+    uint64_t insts = 0;
+    while (chip8->cycles < deadline)
+    {
+        // idle loops only hold one cycle instructions, so after one real
+        // pass the whole passes left are skipped and the rest run as usual
+        const uint32_t length = config->idle_skip ? idle_loop_at(chip8) : 0;
+        if (length > 0 && deadline - chip8->cycles >= 2 * length)
+        {
+            const uint64_t skipped = (deadline - chip8->cycles - length) / length * length;
+            run_backend(chip8, config->backend, length);
+            chip8->idle_skipped += skipped;
+            chip8->cycles += length + skipped;
+            insts += length + skipped;
+            continue;
+        }
+
+        // checked for idle loops every IDLE_CHECK_INTERVAL cycles
+        const uint64_t left = deadline - chip8->cycles;
+        const uint64_t slice = config->idle_skip && left > IDLE_CHECK_INTERVAL ? IDLE_CHECK_INTERVAL : left;
+        insts += run_backend_cycles(chip8, config->backend, chip8->cycles + slice);
+    }
+    return insts;
+}
+
+void chip8_frame_clock_start(chip8_frame_clock_t *clock, const chip8_t *chip8, uint32_t insts_per_second)
+{
+    clock->deadline = chip8->cycles;
+    clock->insts_per_second = insts_per_second;
+    clock->remainder = 0;
+}
+
+uint32_t chip8_frame_clock_advance(chip8_frame_clock_t *clock)
+{
+    const uint64_t total = (uint64_t)clock->remainder + clock->insts_per_second;
+    clock->remainder = (uint32_t)(total % 60);
+    clock->deadline += total / 60;
+    return (uint32_t)(total / 60);
+}
+
+uint64_t chip8_run_frame(chip8_t *chip8, const core_config_t *config, chip8_frame_clock_t *clock)
+{
+    chip8_frame_clock_advance(clock);
+    return chip8_run_cycles(chip8, config, clock->deadline);
+}
+
+// an idle loop with both timers stopped can only be left through the keypad
+bool chip8_waiting_for_input(const chip8_t *chip8)
+{
+    return chip8->delay_timer == 0 && chip8->sound_timer == 0 && idle_loop_at(chip8) > 0;
+}
+
+// count down delay and sound timers, called at 60hz
+void chip8_tick_timers(chip8_t *chip8)
+{
+    if (chip8->delay_timer > 0)
+        chip8->delay_timer--;
+
+    if (chip8->sound_timer > 0)
+        chip8->sound_timer--;
+}
+
+// ---------------------------------------------------------------------------
+// instance management and host facing helpers
+// ---------------------------------------------------------------------------
+
+// initialise chip8 with a rom image already in memory
+bool chip8_load_rom(chip8_t *chip8, const uint8_t *rom, size_t rom_size, const char *rom_name)
+{
+    const uint32_t entry_point = 0x200;
+    const uint8_t font[] = {
+        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+        0x20, 0x60, 0x20, 0x20, 0x70, // 1
+        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+        0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+    };
+
+    // opcode handlers and recompiled blocks are set up on first use
+    init_dispatch_table();
+    init_aot();
+
+    //clear display array, keeping the recompiler but none of its blocks, the profile, the trace, the seed
+    // and the cycle count, which frontends run deadlines against
+    jit_t *jit = chip8->jit;
+    chip8_profile_t *profile = chip8->profile;
+    chip8_trace_t *trace = chip8->trace;
+    const uint64_t rng_seed = chip8->rng_seed;
+    const uint64_t cycles = chip8->cycles;
+    memset(chip8, 0, sizeof(chip8_t));
+    chip8->jit = jit;
+    chip8->profile = profile;
+    chip8->trace = trace;
+    chip8->rng_seed = rng_seed;
+    chip8->cycles = cycles;
+    chip8->rng_state = chip8_rng_from_seed(rng_seed);
+    if (jit)
+        jit_flush(jit);
+
+    // load font
+    memcpy(&chip8->ram[0], font, sizeof(font));
+
+    // load rom
+    const size_t max_size = sizeof chip8->ram - entry_point;
+    if (rom_size > max_size)
+    {
+        fprintf(stderr, "Rom file '%s' is too big!\nRom size: %zu\nMax size: %zu\n", rom_name, rom_size, max_size);
+        return false;
+    }
+    memcpy(&chip8->ram[entry_point], rom, rom_size);
+
+    chip8->state = RUNNING; // default machine state
+    chip8->PC = entry_point;
+    chip8->rom_name = rom_name;
+    chip8->stack_ptr = &chip8->stack[0];
+    chip8->sound_timer = 0;
+    chip8->delay_timer = 0;
+    chip8->dirty_rows = ~0u; // present the cleared screen on the first frame
+
+    return true;
+}
+
+// initialise chip8 with a rom file
+bool chip8_load_rom_file(chip8_t *chip8, const char *rom_name)
+{
+    uint8_t data[4096];
+
+    FILE *rom = fopen(rom_name, "rb");
+    if (!rom)
+    {
+        fprintf(stderr, "Rom file '%s' is invalid or does not exist!\n", rom_name);
+        return false;
+    }
+
+    // read one byte more than fits so oversized roms are reported
+    const size_t rom_size = fread(data, 1, sizeof data, rom);
+    if (ferror(rom))
+    {
+        fprintf(stderr, "Could not read rom file '%s' into memory!\n", rom_name);
+        fclose(rom);
+        return false;
+    }
+    fclose(rom);
+
+    return chip8_load_rom(chip8, data, rom_size, rom_name);
+}
+
+// allocate a zeroed instance; load a rom before running it
+chip8_t *chip8_create(void)
+{
+    chip8_t *chip8 = (chip8_t *)calloc(1, sizeof(chip8_t));
+#ifdef PROFILE
+    init_profile_classes();
+    if (chip8 && !(chip8->profile = (chip8_profile_t *)malloc(sizeof(chip8_profile_t))))
+    {
+        free(chip8);
+        return NULL;
+    }
+    if (chip8)
+        chip8_profile_reset(chip8);
+#endif
+    return chip8;
+}
+
+// release an instance and its recompiler
+void chip8_destroy(chip8_t *chip8)
+{
+    if (!chip8)
+        return;
+
+    chip8_trace_stop(chip8);
+    jit_destroy(chip8);
+    free(chip8->profile);
+    free(chip8);
+}
+
+void chip8_seed(chip8_t *chip8, uint64_t seed)
+{
+    chip8->rng_seed = seed;
+    chip8->rng_state = chip8_rng_from_seed(seed);
+}
+
+// default core settings
+void chip8_default_config(core_config_t *config)
+{
+#ifdef AOT_ROM
+    config->backend = BACKEND_AOT;
+#else
+    config->backend = BACKEND_CACHED;
+#endif
+    config->idle_skip = true;
+    config->cycle_costs = false;
+}
+
+static const char *const backend_names[BACKEND_COUNT] = {"switch", "table", "cached", "jit", "aot"};
+
+const char *chip8_backend_name(backend_t backend)
+{
+    return backend < BACKEND_COUNT ? backend_names[backend] : "unknown";
+}
+
+// look up a backend by name, aot only when a recompiled rom was built in
+bool chip8_backend_from_name(const char *name, backend_t *backend)
+{
+    for (int i = 0; i < BACKEND_COUNT; i++)
+    {
+        if (strcmp(name, backend_names[i]) == 0)
+        {
+#ifndef AOT_ROM
+            if (i == BACKEND_AOT)
+                return false;
+#endif
+            *backend = (backend_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void chip8_set_key(chip8_t *chip8, uint8_t key, bool down)
+{
+    chip8->keypad[key & 0xF] = down;
+}
+
+void chip8_set_keys(chip8_t *chip8, uint16_t keys)
+{
+    for (uint8_t i = 0; i < 16; i++)
+        chip8->keypad[i] = (keys >> i) & 1;
+}
+
+const uint64_t *chip8_framebuffer(const chip8_t *chip8)
+{
+    return chip8->display;
+}
+
+// monotonic host clock in nanoseconds
+uint64_t chip8_time_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ull +
+           (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ull / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// host CPU time of the whole process in nanoseconds, all threads
+uint64_t chip8_cpu_time_ns(void)
+{
+#ifdef _WIN32
+    FILETIME creation, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel, &user))
+        return 0;
+    const uint64_t ticks = ((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+                           ((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime);
+    return ticks * 100; // 100 ns units
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// save states
+// ---------------------------------------------------------------------------
+
+static uint16_t keypad_mask(const chip8_t *chip8)
+{
+    uint16_t keys = 0;
+    for (uint8_t i = 0; i < 16; i++)
+        keys |= (uint16_t)chip8->keypad[i] << i;
+    return keys;
+}
+
+void chip8_snapshot(const chip8_t *chip8, chip8_state_t *state)
+{
+    memcpy(state->ram, chip8->ram, sizeof state->ram);
+    memcpy(state->display, chip8->display, sizeof state->display);
+    memcpy(state->stack, chip8->stack, sizeof state->stack);
+    state->stack_depth = (uint8_t)(chip8->stack_ptr - chip8->stack);
+    memcpy(state->V, chip8->V, sizeof state->V);
+    state->I = chip8->I;
+    state->PC = chip8->PC;
+    state->delay_timer = chip8->delay_timer;
+    state->sound_timer = chip8->sound_timer;
+    state->keys = keypad_mask(chip8);
+    state->rng_seed = chip8->rng_seed;
+    state->rng_state = chip8->rng_state;
+    memcpy(state->ram_written, chip8->ram_written, sizeof state->ram_written);
+}
+
+void chip8_restore(chip8_t *chip8, const chip8_state_t *state)
+{
+    // a block compare finds the few bytes that differ between nearby frames,
+    // only code under those has to be decoded or recompiled again
+    for (uint32_t block = 0; block < sizeof state->ram; block += 64)
+    {
+        if (memcmp(&chip8->ram[block], &state->ram[block], 64) == 0)
+            continue;
+
+        for (uint32_t address = block; address < block + 64; address++)
+        {
+            if (chip8->ram[address] != state->ram[address])
+                invalidate_code(chip8, (uint16_t)address);
+        }
+    }
+
+    memcpy(chip8->ram, state->ram, sizeof chip8->ram);
+    memcpy(chip8->display, state->display, sizeof chip8->display);
+    memcpy(chip8->stack, state->stack, sizeof chip8->stack);
+    chip8->stack_ptr = &chip8->stack[state->stack_depth < 12 ? state->stack_depth : 12];
+    memcpy(chip8->V, state->V, sizeof chip8->V);
+    chip8->I = state->I;
+    chip8->PC = state->PC;
+    chip8->delay_timer = state->delay_timer;
+    chip8->sound_timer = state->sound_timer;
+    for (uint8_t i = 0; i < 16; i++)
+        chip8->keypad[i] = (state->keys >> i) & 1;
+    chip8->rng_seed = state->rng_seed;
+    chip8->rng_state = state->rng_state;
+    memcpy(chip8->ram_written, state->ram_written, sizeof chip8->ram_written);
+    chip8->dirty_rows = ~0u; // the whole screen may have changed
+}
+
+static uint8_t *put_bytes(uint8_t *out, const void *data, size_t size)
+{
+    memcpy(out, data, size);
+    return out + size;
+}
+
+static uint8_t *put_le(uint8_t *out, uint64_t value, uint8_t bytes)
+{
+    for (uint8_t i = 0; i < bytes; i++)
+        *out++ = (uint8_t)(value >> (8 * i));
+    return out;
+}
+
+static const uint8_t *get_le(const uint8_t *in, uint64_t *value, uint8_t bytes)
+{
+    *value = 0;
+    for (uint8_t i = 0; i < bytes; i++)
+        *value |= (uint64_t)*in++ << (8 * i);
+    return in;
+}
+
+void chip8_state_serialize(const chip8_state_t *state, uint8_t *buffer)
+{
+    uint8_t *out = put_bytes(buffer, "C8ST", 4);
+    out = put_le(out, CHIP8_STATE_VERSION, 2);
+    out = put_le(out, 0, 2); // flags, none defined yet
+    out = put_le(out, CHIP8_STATE_BYTES - CHIP8_STATE_HEADER_BYTES, 4);
+
+    out = put_bytes(out, state->ram, sizeof state->ram);
+    for (uint32_t row = 0; row < DISPLAY_HEIGHT; row++)
+        out = put_le(out, state->display[row], 8);
+    for (uint32_t i = 0; i < 12; i++)
+        out = put_le(out, state->stack[i], 2);
+    out = put_le(out, state->stack_depth, 1);
+    out = put_bytes(out, state->V, sizeof state->V);
+    out = put_le(out, state->I, 2);
+    out = put_le(out, state->PC, 2);
+    out = put_le(out, state->delay_timer, 1);
+    out = put_le(out, state->sound_timer, 1);
+    out = put_le(out, state->keys, 2);
+    out = put_le(out, state->rng_seed, 8);
+    out = put_le(out, state->rng_state, 8);
+    for (uint32_t i = 0; i < 64; i++)
+        out = put_le(out, state->ram_written[i], 8);
+}
+
+bool chip8_state_deserialize(const uint8_t *buffer, size_t size, chip8_state_t *state)
+{
+    uint64_t version, flags, payload, value;
+    if (size != CHIP8_STATE_BYTES || memcmp(buffer, "C8ST", 4) != 0)
+        return false;
+
+    const uint8_t *in = get_le(buffer + 4, &version, 2);
+    in = get_le(in, &flags, 2);
+    in = get_le(in, &payload, 4);
+    if (version != CHIP8_STATE_VERSION || flags != 0 || payload != CHIP8_STATE_BYTES - CHIP8_STATE_HEADER_BYTES)
+        return false;
+
+    memcpy(state->ram, in, sizeof state->ram);
+    in += sizeof state->ram;
+    for (uint32_t row = 0; row < DISPLAY_HEIGHT; row++)
+        in = get_le(in, &state->display[row], 8);
+    for (uint32_t i = 0; i < 12; i++)
+    {
+        in = get_le(in, &value, 2);
+        state->stack[i] = (uint16_t)value;
+    }
+    in = get_le(in, &value, 1);
+    state->stack_depth = (uint8_t)value;
+    memcpy(state->V, in, sizeof state->V);
+    in += sizeof state->V;
+    in = get_le(in, &value, 2);
+    state->I = (uint16_t)value;
+    in = get_le(in, &value, 2);
+    state->PC = (uint16_t)value;
+    in = get_le(in, &value, 1);
+    state->delay_timer = (uint8_t)value;
+    in = get_le(in, &value, 1);
+    state->sound_timer = (uint8_t)value;
+    in = get_le(in, &value, 2);
+    state->keys = (uint16_t)value;
+    in = get_le(in, &state->rng_seed, 8);
+    in = get_le(in, &state->rng_state, 8);
+    for (uint32_t i = 0; i < 64; i++)
+        in = get_le(in, &state->ram_written[i], 8);
+
+    // a stack deeper than the machine has cannot come from a real run
+    return state->stack_depth <= 12 && state->PC < 4096;
+}
+
+bool chip8_save_state_file(const chip8_t *chip8, const char *file_name)
+{
+    chip8_state_t state;
+    uint8_t buffer[CHIP8_STATE_BYTES];
+    chip8_snapshot(chip8, &state);
+    chip8_state_serialize(&state, buffer);
+
+    FILE *file = fopen(file_name, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Could not open state file '%s' for writing!\n", file_name);
+        return false;
+    }
+    const bool written = fwrite(buffer, 1, sizeof buffer, file) == sizeof buffer;
+    if (fclose(file) != 0 || !written)
+    {
+        fprintf(stderr, "Could not write state file '%s'!\n", file_name);
+        return false;
+    }
+    return true;
+}
+
+bool chip8_load_state_file(chip8_t *chip8, const char *file_name)
+{
+    uint8_t buffer[CHIP8_STATE_BYTES + 1];
+    chip8_state_t state;
+
+    FILE *file = fopen(file_name, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "State file '%s' is invalid or does not exist!\n", file_name);
+        return false;
+    }
+
+    // read one byte more than fits so oversized files are rejected
+    const size_t size = fread(buffer, 1, sizeof buffer, file);
+    fclose(file);
+    if (!chip8_state_deserialize(buffer, size, &state))
+    {
+        fprintf(stderr, "State file '%s' is not a version %d chip8 state!\n", file_name, CHIP8_STATE_VERSION);
+        return false;
+    }
+
+    chip8_restore(chip8, &state);
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// input movies
+// ---------------------------------------------------------------------------
+
+// FNV-1a over the display rows, folded into the running hash
+static uint64_t hash_display(uint64_t hash, const chip8_t *chip8)
+{
+    for (uint32_t row = 0; row < DISPLAY_HEIGHT; row++)
+    {
+        for (uint8_t i = 0; i < 8; i++)
+        {
+            hash ^= (uint8_t)(chip8->display[row] >> (8 * i));
+            hash *= 0x100000001B3ull;
+        }
+    }
+    return hash;
+}
+
+static void start_position(chip8_movie_position_t *position)
+{
+    position->frames = 0;
+    position->insts = 0;
+    position->display_hash = 0xCBF29CE484222325ull;
+    position->next_event = 0;
+}
+
+static bool append_event(chip8_movie_t *movie, const chip8_movie_event_t *event)
+{
+    if (movie->event_count == movie->event_capacity)
+    {
+        const uint32_t capacity = movie->event_capacity ? movie->event_capacity * 2 : 256;
+        chip8_movie_event_t *events = (chip8_movie_event_t *)realloc(movie->events, capacity * sizeof(chip8_movie_event_t));
+        if (!events)
+            return false;
+        movie->events = events;
+        movie->event_capacity = capacity;
+    }
+    movie->events[movie->event_count++] = *event;
+    return true;
+}
+
+void chip8_movie_begin(chip8_movie_t *movie, const chip8_t *chip8, const core_config_t *config, uint32_t insts_per_second)
+{
+    memset(movie, 0, sizeof(chip8_movie_t));
+    movie->seed = chip8->rng_seed;
+    movie->insts_per_second = insts_per_second;
+    movie->config = *config;
+    chip8_snapshot(chip8, &movie->start);
+    start_position(&movie->end);
+}
+
+// note the keys if they changed since the last frame
+bool chip8_movie_record_keys(chip8_movie_t *movie, const chip8_t *chip8)
+{
+    const uint16_t keys = keypad_mask(chip8);
+    const uint16_t previous = movie->event_count ? movie->events[movie->event_count - 1].keys : movie->start.keys;
+    if (keys == previous)
+        return true;
+
+    const chip8_movie_event_t event = {movie->end.frames, movie->end.insts, keys};
+    return append_event(movie, &event);
+}
+
+void chip8_movie_end_frame(chip8_movie_position_t *position, const chip8_t *chip8, uint64_t insts)
+{
+    position->frames++;
+    position->insts += insts;
+    position->display_hash = hash_display(position->display_hash, chip8);
+}
+
+void chip8_movie_start(const chip8_movie_t *movie, chip8_t *chip8, chip8_movie_position_t *position)
+{
+    chip8_restore(chip8, &movie->start);
+    start_position(position);
+}
+
+bool chip8_movie_play_keys(const chip8_movie_t *movie, chip8_movie_position_t *position, chip8_t *chip8)
+{
+    if (position->frames >= movie->end.frames)
+        return false;
+
+    while (position->next_event < movie->event_count && movie->events[position->next_event].frame == position->frames)
+    {
+        const chip8_movie_event_t *event = &movie->events[position->next_event++];
+        if (event->insts != position->insts)
+            return false; // played at another rate than recorded
+        chip8_set_keys(chip8, event->keys);
+    }
+    return true;
+}
+
+bool chip8_save_movie_file(const chip8_movie_t *movie, const char *file_name)
+{
+    uint8_t header[CHIP8_MOVIE_HEADER_BYTES];
+    uint8_t *out = put_bytes(header, "C8MV", 4);
+    out = put_le(out, CHIP8_MOVIE_VERSION, 2);
+    out = put_le(out, 0, 2); // flags, none defined yet
+    out = put_le(out, movie->seed, 8);
+    out = put_le(out, movie->insts_per_second, 4);
+    out = put_le(out, movie->config.backend, 1);
+    out = put_le(out, movie->config.idle_skip, 1);
+    out = put_le(out, movie->config.cycle_costs, 1);
+    out = put_le(out, movie->end.frames, 8);
+    out = put_le(out, movie->end.insts, 8);
+    out = put_le(out, movie->end.display_hash, 8);
+    put_le(out, movie->event_count, 4);
+
+    uint8_t state[CHIP8_STATE_BYTES];
+    chip8_state_serialize(&movie->start, state);
+
+    FILE *file = fopen(file_name, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Could not open movie file '%s' for writing!\n", file_name);
+        return false;
+    }
+    bool written = fwrite(header, 1, sizeof header, file) == sizeof header &&
+                   fwrite(state, 1, sizeof state, file) == sizeof state;
+    for (uint32_t i = 0; written && i < movie->event_count; i++)
+    {
+        uint8_t event[CHIP8_MOVIE_EVENT_BYTES];
+        out = put_le(event, movie->events[i].frame, 8);
+        out = put_le(out, movie->events[i].insts, 8);
+        put_le(out, movie->events[i].keys, 2);
+        written = fwrite(event, 1, sizeof event, file) == sizeof event;
+    }
+    if (fclose(file) != 0 || !written)
+    {
+        fprintf(stderr, "Could not write movie file '%s'!\n", file_name);
+        return false;
+    }
+    return true;
+}
+
+bool chip8_load_movie_file(chip8_movie_t *movie, const char *file_name)
+{
+    uint8_t header[CHIP8_MOVIE_HEADER_BYTES];
+    uint8_t state[CHIP8_STATE_BYTES];
+    uint64_t version, flags, value, event_count;
+
+    memset(movie, 0, sizeof(chip8_movie_t));
+    FILE *file = fopen(file_name, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Movie file '%s' is invalid or does not exist!\n", file_name);
+        return false;
+    }
+
+    bool valid = fread(header, 1, sizeof header, file) == sizeof header && memcmp(header, "C8MV", 4) == 0;
+    if (valid)
+    {
+        const uint8_t *in = get_le(header + 4, &version, 2);
+        in = get_le(in, &flags, 2);
+        in = get_le(in, &movie->seed, 8);
+        in = get_le(in, &value, 4);
+        movie->insts_per_second = (uint32_t)value;
+        in = get_le(in, &value, 1);
+        movie->config.backend = (backend_t)value;
+        in = get_le(in, &value, 1);
+        movie->config.idle_skip = value != 0;
+        in = get_le(in, &value, 1);
+        movie->config.cycle_costs = value != 0;
+        in = get_le(in, &movie->end.frames, 8);
+        in = get_le(in, &movie->end.insts, 8);
+        in = get_le(in, &movie->end.display_hash, 8);
+        get_le(in, &event_count, 4);
+        valid = version == CHIP8_MOVIE_VERSION && flags == 0 && movie->config.backend < BACKEND_COUNT &&
+                fread(state, 1, sizeof state, file) == sizeof state &&
+                chip8_state_deserialize(state, sizeof state, &movie->start);
+    }
+
+    for (uint64_t i = 0; valid && i < event_count; i++)
+    {
+        uint8_t bytes[CHIP8_MOVIE_EVENT_BYTES];
+        chip8_movie_event_t event;
+        valid = fread(bytes, 1, sizeof bytes, file) == sizeof bytes;
+        const uint8_t *in = get_le(bytes, &event.frame, 8);
+        in = get_le(in, &event.insts, 8);
+        get_le(in, &value, 2);
+        event.keys = (uint16_t)value;
+        valid = valid && append_event(movie, &event);
+    }
+    fclose(file);
+
+    if (!valid)
+    {
+        fprintf(stderr, "Movie file '%s' is not a version %d chip8 movie!\n", file_name, CHIP8_MOVIE_VERSION);
+        chip8_movie_free(movie);
+        return false;
+    }
+    return true;
+}
+
+void chip8_movie_free(chip8_movie_t *movie)
+{
+    free(movie->events);
+    movie->events = NULL;
+    movie->event_count = 0;
+    movie->event_capacity = 0;
+}
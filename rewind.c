@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// ---------------------------------------------------------------------------
+// rewind buffer
+//
+// One record per frame in a byte ring with a fixed memory cap. Every
+// keyframe_interval frames a keyframe is stored; the frames in between are
+// stored as the XOR of their state against that keyframe, run length coded
+// so the unchanged bulk of ram costs a few bytes. Keyframes are coded the
+// same way against an all-zero state. Any frame decodes from its keyframe
+// alone, and the oldest records are evicted a keyframe group at a time.
+//
+// Coded record: a sequence of (u16 zero run, u16 literal length, literal
+// bytes) until the state is covered.
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+    uint32_t offset; // start of the record in the ring
+    uint32_t size;
+    uint64_t serial;     // push counter of this frame
+    uint64_t key_serial; // serial of the keyframe it is coded against
+} rewind_entry_t;
+
+struct chip8_rewind_t
+{
+    uint8_t *ring;
+    uint32_t ring_size;
+    uint32_t head; // next free byte
+
+    rewind_entry_t *entries; // circular, oldest at first
+    uint32_t entry_capacity;
+    uint32_t first;
+    uint32_t count;
+
+    uint32_t keyframe_interval;
+    uint64_t next_serial;
+
+    chip8_state_t key;   // decoded state of the keyframe key_serial
+    uint64_t key_serial; // 0 when no keyframe is decoded
+    chip8_state_t scratch;
+    uint8_t *coded; // worst case coding buffer
+
+    chip8_rewind_stats_t stats;
+};
+
+// worst case coding: one 4 byte header per changed byte after a 4 byte gap
+#define CODED_MAX (sizeof(chip8_state_t) * 2 + 8)
+
+static rewind_entry_t *entry_at(chip8_rewind_t *rewind, uint32_t index)
+{
+    return &rewind->entries[(rewind->first + index) % rewind->entry_capacity];
+}
+
+// XOR state against base and run length code the result
+static uint32_t encode(const chip8_state_t *state, const chip8_state_t *base, uint8_t *out)
+{
+    const uint8_t *a = (const uint8_t *)state;
+    const uint8_t *b = (const uint8_t *)base;
+    const uint32_t size = sizeof(chip8_state_t);
+    uint32_t used = 0;
+    uint32_t i = 0;
+
+    while (i < size)
+    {
+        const uint32_t zero_start = i;
+        while (i < size && a[i] == b[i])
+            i++;
+        const uint32_t zeros = i - zero_start;
+
+        // a literal keeps going over unchanged gaps too short to pay for a header
+        const uint32_t literal_start = i;
+        uint32_t literal_end = i;
+        while (i < size)
+        {
+            if (a[i] != b[i])
+            {
+                literal_end = ++i;
+                continue;
+            }
+            uint32_t gap = i;
+            while (gap < size && gap - i < 4 && a[gap] == b[gap])
+                gap++;
+            if (gap - i >= 4 || gap == size)
+                break;
+            i = gap;
+        }
+        i = literal_end;
+        const uint32_t literals = literal_end - literal_start;
+
+        out[used++] = (uint8_t)zeros;
+        out[used++] = (uint8_t)(zeros >> 8);
+        out[used++] = (uint8_t)literals;
+        out[used++] = (uint8_t)(literals >> 8);
+        for (uint32_t j = literal_start; j < literal_end; j++)
+            out[used++] = a[j] ^ b[j];
+    }
+
+    return used;
+}
+
+// rebuild a state from its base and coded XOR
+static void decode(const uint8_t *in, uint32_t size, const chip8_state_t *base, chip8_state_t *state)
+{
+    uint8_t *out = (uint8_t *)state;
+    uint32_t position = 0;
+
+    memcpy(state, base, sizeof(chip8_state_t));
+    for (uint32_t used = 0; used + 4 <= size;)
+    {
+        position += in[used] | (in[used + 1] << 8);
+        const uint32_t literals = in[used + 2] | (in[used + 3] << 8);
+        used += 4;
+        for (uint32_t j = 0; j < literals; j++)
+            out[position++] ^= in[used++];
+    }
+}
+
+static const chip8_state_t *zero_state(void)
+{
+    static chip8_state_t zero; // zero initialised
+    return &zero;
+}
+
+// drop the oldest keyframe and the frames coded against it
+static void evict_oldest_group(chip8_rewind_t *rewind)
+{
+    const uint64_t key_serial = entry_at(rewind, 0)->key_serial;
+    while (rewind->count > 0 && entry_at(rewind, 0)->key_serial == key_serial)
+    {
+        rewind->stats.bytes_held -= entry_at(rewind, 0)->size;
+        rewind->first = (rewind->first + 1) % rewind->entry_capacity;
+        rewind->count--;
+    }
+    if (rewind->key_serial == key_serial)
+        rewind->key_serial = 0;
+}
+
+// find room for size bytes, evicting old groups as needed
+static bool ring_alloc(chip8_rewind_t *rewind, uint32_t size, uint32_t *offset)
+{
+    if (size >= rewind->ring_size)
+        return false;
+
+    for (;;)
+    {
+        if (rewind->count == 0)
+        {
+            rewind->head = 0;
+            *offset = 0;
+            return true;
+        }
+
+        // live data is [tail, head), or wraps as [tail, end) + [0, head)
+        const uint32_t tail = entry_at(rewind, 0)->offset;
+        const uint32_t head = rewind->head;
+        if (head > tail)
+        {
+            if (head + size <= rewind->ring_size)
+            {
+                *offset = head;
+                return true;
+            }
+            if (size < tail)
+            {
+                *offset = 0;
+                return true;
+            }
+        }
+        else if (head + size < tail)
+        {
+            *offset = head;
+            return true;
+        }
+
+        evict_oldest_group(rewind);
+    }
+}
+
+static bool grow_entries(chip8_rewind_t *rewind)
+{
+    const uint32_t capacity = rewind->entry_capacity ? rewind->entry_capacity * 2 : 1024;
+    rewind_entry_t *entries = (rewind_entry_t *)malloc(capacity * sizeof(rewind_entry_t));
+    if (!entries)
+        return false;
+
+    for (uint32_t i = 0; i < rewind->count; i++)
+        entries[i] = *entry_at(rewind, i);
+    free(rewind->entries);
+    rewind->entries = entries;
+    rewind->entry_capacity = capacity;
+    rewind->first = 0;
+    return true;
+}
+
+// decode the keyframe with the given serial into rewind->key
+static void load_keyframe(chip8_rewind_t *rewind, uint64_t key_serial)
+{
+    if (rewind->key_serial == key_serial)
+        return;
+
+    for (uint32_t i = rewind->count; i-- > 0;)
+    {
+        const rewind_entry_t *entry = entry_at(rewind, i);
+        if (entry->serial == key_serial)
+        {
+            decode(&rewind->ring[entry->offset], entry->size, zero_state(), &rewind->key);
+            rewind->key_serial = key_serial;
+            return;
+        }
+    }
+}
+
+chip8_rewind_t *chip8_rewind_create(size_t memory_cap, uint32_t keyframe_interval)
+{
+    if (memory_cap < CODED_MAX * 2 || memory_cap > UINT32_MAX || keyframe_interval == 0)
+        return NULL;
+
+    chip8_rewind_t *rewind = (chip8_rewind_t *)calloc(1, sizeof(chip8_rewind_t));
+    if (!rewind)
+        return NULL;
+
+    rewind->ring = (uint8_t *)malloc(memory_cap);
+    rewind->coded = (uint8_t *)malloc(CODED_MAX);
+    if (!rewind->ring || !rewind->coded || !grow_entries(rewind))
+    {
+        chip8_rewind_destroy(rewind);
+        return NULL;
+    }
+    rewind->ring_size = (uint32_t)memory_cap;
+    rewind->keyframe_interval = keyframe_interval;
+    rewind->next_serial = 1;
+    return rewind;
+}
+
+void chip8_rewind_destroy(chip8_rewind_t *rewind)
+{
+    if (!rewind)
+        return;
+
+    free(rewind->ring);
+    free(rewind->coded);
+    free(rewind->entries);
+    free(rewind);
+}
+
+void chip8_rewind_clear(chip8_rewind_t *rewind)
+{
+    rewind->count = 0;
+    rewind->first = 0;
+    rewind->head = 0;
+    rewind->key_serial = 0;
+    rewind->stats.frames_held = 0;
+    rewind->stats.bytes_held = 0;
+}
+
+// record the current frame, call once per frame boundary
+bool chip8_rewind_push(chip8_rewind_t *rewind, const chip8_t *chip8)
+{
+    chip8_snapshot(chip8, &rewind->scratch);
+    if (rewind->count == rewind->entry_capacity && !grow_entries(rewind))
+        return false;
+
+    for (;;)
+    {
+        // a new keyframe when due, or when the last one was rewound or evicted
+        const rewind_entry_t *newest = rewind->count ? entry_at(rewind, rewind->count - 1) : NULL;
+        const bool keyframe = !newest || newest->serial - newest->key_serial + 1 >= rewind->keyframe_interval;
+        const uint64_t key_serial = keyframe ? rewind->next_serial : newest->key_serial;
+        if (!keyframe)
+            load_keyframe(rewind, key_serial);
+
+        const uint32_t size = encode(&rewind->scratch, keyframe ? zero_state() : &rewind->key, rewind->coded);
+        uint32_t offset;
+        if (!ring_alloc(rewind, size, &offset))
+            return false;
+
+        // making room evicted this frame's own group, start over as a keyframe
+        if (!keyframe && rewind->count == 0)
+            continue;
+
+        memcpy(&rewind->ring[offset], rewind->coded, size);
+        rewind->head = offset + size;
+
+        rewind_entry_t *entry = entry_at(rewind, rewind->count++);
+        entry->offset = offset;
+        entry->size = size;
+        entry->serial = rewind->next_serial++;
+        entry->key_serial = key_serial;
+
+        if (keyframe)
+        {
+            memcpy(&rewind->key, &rewind->scratch, sizeof(chip8_state_t));
+            rewind->key_serial = key_serial;
+            rewind->stats.keyframes_pushed++;
+        }
+        rewind->stats.frames_pushed++;
+        rewind->stats.bytes_pushed += size;
+        rewind->stats.bytes_held += size;
+        rewind->stats.frames_held = rewind->count;
+        return true;
+    }
+}
+
+// step the instance back to the newest recorded frame and forget it; false
+// once the buffer is empty
+bool chip8_rewind_pop(chip8_rewind_t *rewind, chip8_t *chip8)
+{
+    if (rewind->count == 0)
+        return false;
+
+    const uint64_t start_time = chip8_time_ns();
+    const rewind_entry_t *entry = entry_at(rewind, rewind->count - 1);
+    if (entry->serial == entry->key_serial)
+        decode(&rewind->ring[entry->offset], entry->size, zero_state(), &rewind->scratch);
+    else
+    {
+        load_keyframe(rewind, entry->key_serial);
+        decode(&rewind->ring[entry->offset], entry->size, &rewind->key, &rewind->scratch);
+    }
+    chip8_restore(chip8, &rewind->scratch);
+
+    rewind->head = entry->offset;
+    rewind->stats.bytes_held -= entry->size;
+    if (entry->serial == rewind->key_serial)
+        rewind->key_serial = 0;
+    rewind->count--;
+    rewind->stats.frames_held = rewind->count;
+
+    rewind->stats.frames_popped++;
+    rewind->stats.pop_ns += chip8_time_ns() - start_time;
+    return true;
+}
+
+const chip8_rewind_stats_t *chip8_rewind_stats(const chip8_rewind_t *rewind)
+{
+    return &rewind->stats;
+}
@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// ---------------------------------------------------------------------------
+// structure-of-arrays lockstep engine
+//
+// Every piece of machine state is stored lane-minor, state[...][lane], so the
+// same register or ram byte of all lanes sits in one contiguous run. Each
+// instruction round every lane executes exactly one instruction: lanes are
+// grouped by PC and opcode, and a group runs as one pass of masked loops over
+// all lanes that the compiler turns into SIMD blends (16 bytes at a time,
+// or 32 with SIMD=-mavx2 on cpus that have it). A lane that diverged from the rest runs
+// alone through the same code, limited to its own index, i.e. scalar.
+// ---------------------------------------------------------------------------
+
+struct chip8_soa_t
+{
+    uint8_t ram[4096][CHIP8_SOA_LANES];
+    uint64_t display[DISPLAY_HEIGHT][CHIP8_SOA_LANES];
+    uint16_t stack[12][CHIP8_SOA_LANES];
+    uint8_t V[16][CHIP8_SOA_LANES];
+    uint16_t I[CHIP8_SOA_LANES];
+    uint16_t PC[CHIP8_SOA_LANES];
+    uint8_t sp[CHIP8_SOA_LANES]; // stack depth
+    uint8_t delay_timer[CHIP8_SOA_LANES];
+    uint8_t sound_timer[CHIP8_SOA_LANES];
+    uint16_t keys[CHIP8_SOA_LANES]; // keypad bitmask, bit n is key n
+    uint64_t rng_seed[CHIP8_SOA_LANES];
+    uint64_t rng_state[CHIP8_SOA_LANES];
+    uint32_t lanes;                // lanes in use, the rest never run
+    chip8_soa_stats_t stats;
+};
+
+#define FOR_LANES for (uint32_t l = lo; l <= hi; l++)
+
+// run one decoded opcode on the lanes in [lo, hi] whose mask byte is set;
+// operations keep the order of the scalar handlers so VF aliasing matches
+static void soa_execute(chip8_soa_t *soa, const uint8_t *m, uint32_t lo, uint32_t hi, uint16_t opcode)
+{
+    const uint16_t NNN = opcode & 0x0FFF;
+    const uint8_t NN = opcode & 0x00FF;
+    const uint8_t N = opcode & 0x000F;
+    const uint8_t X = (opcode & 0x0F00) >> 8;
+    const uint8_t Y = (opcode & 0x00F0) >> 4;
+    uint8_t *VX = soa->V[X];
+    uint8_t *VY = soa->V[Y];
+    uint8_t *VF = soa->V[0xF];
+    uint16_t *PC = soa->PC;
+
+    // every opcode first steps past itself
+    FOR_LANES PC[l] += m[l] ? 2 : 0;
+
+    switch ((opcode >> 12) & 0xF)
+    {
+    case 0x0:
+        if (NN == 0xE0) // clear screen
+        {
+            for (uint8_t row = 0; row < DISPLAY_HEIGHT; row++)
+                FOR_LANES soa->display[row][l] = m[l] ? 0 : soa->display[row][l];
+        }
+        else if (NN == 0xEE) // return from subroutine
+        {
+            FOR_LANES soa->sp[l] -= m[l] ? 1 : 0;
+            FOR_LANES PC[l] = m[l] ? soa->stack[soa->sp[l] % 12][l] : PC[l];
+        }
+        break;
+
+    case 0x1: // jump to address NNN
+        FOR_LANES PC[l] = m[l] ? NNN : PC[l];
+        break;
+
+    case 0x2: // call subroutine at NNN
+        FOR_LANES
+        {
+            if (m[l])
+                soa->stack[soa->sp[l]++ % 12][l] = PC[l];
+        }
+        FOR_LANES PC[l] = m[l] ? NNN : PC[l];
+        break;
+
+    case 0x3: // skip if V[X] == NN
+        FOR_LANES PC[l] += (m[l] && VX[l] == NN) ? 2 : 0;
+        break;
+
+    case 0x4: // skip if V[X] != NN
+        FOR_LANES PC[l] += (m[l] && VX[l] != NN) ? 2 : 0;
+        break;
+
+    case 0x5: // skip if V[X] == V[Y]
+        if (N == 0)
+            FOR_LANES PC[l] += (m[l] && VX[l] == VY[l]) ? 2 : 0;
+        break;
+
+    case 0x6: // set V[X] to NN
+        FOR_LANES VX[l] = m[l] ? NN : VX[l];
+        break;
+
+    case 0x7: // add NN to V[X] (carry flag is not changed)
+        FOR_LANES VX[l] += m[l] ? NN : 0;
+        break;
+
+    case 0x8:
+        switch (N)
+        {
+        case 0x0: FOR_LANES VX[l] = m[l] ? VY[l] : VX[l]; break;
+        case 0x1: FOR_LANES VX[l] = m[l] ? VX[l] | VY[l] : VX[l]; break;
+        case 0x2: FOR_LANES VX[l] = m[l] ? VX[l] & VY[l] : VX[l]; break;
+        case 0x3: FOR_LANES VX[l] = m[l] ? VX[l] ^ VY[l] : VX[l]; break;
+        case 0x4: // set V[X] += V[Y], set V[F] to 1 if carry
+            FOR_LANES VF[l] = m[l] ? (uint16_t)(VX[l] + VY[l]) > 255 : VF[l];
+            FOR_LANES VX[l] += m[l] ? VY[l] : 0;
+            break;
+        case 0x5: // set V[X] -= V[Y], set V[F] to 1 if no borrow
+            FOR_LANES VF[l] = m[l] ? VX[l] >= VY[l] : VF[l];
+            FOR_LANES VX[l] -= m[l] ? VY[l] : 0;
+            break;
+        case 0x6: // stores the LSB of V[X] in V[F] and sets V[X] >>= 1
+            FOR_LANES VF[l] = m[l] ? VX[l] & 0x01 : VF[l];
+            FOR_LANES VX[l] = m[l] ? VX[l] >> 1 : VX[l];
+            break;
+        case 0x7: // set V[X] = V[Y] - V[X]
+            FOR_LANES VF[l] = m[l] ? VY[l] >= VX[l] : VF[l];
+            FOR_LANES VX[l] = m[l] ? VY[l] - VX[l] : VX[l];
+            break;
+        case 0xE: // stores the MSB of V[X] in V[F] and sets V[X] <<= 1
+            FOR_LANES VF[l] = m[l] ? (VX[l] & 0x80) >> 7 : VF[l];
+            FOR_LANES VX[l] = m[l] ? VX[l] << 1 : VX[l];
+            break;
+        default:
+            break;
+        }
+        break;
+
+    case 0x9: // skip if V[X] != V[Y]
+        if (N == 0)
+            FOR_LANES PC[l] += (m[l] && VX[l] != VY[l]) ? 2 : 0;
+        break;
+
+    case 0xA: // set index reg to NNN
+        FOR_LANES soa->I[l] = m[l] ? NNN : soa->I[l];
+        break;
+
+    case 0xB: // set PC to V[0] + NNN
+        FOR_LANES PC[l] = m[l] ? soa->V[0][l] + NNN : PC[l];
+        break;
+
+    case 0xC: // set V[X] = rand(0-255) & NN, from each lane's own generator
+        FOR_LANES
+        {
+            if (m[l])
+                VX[l] = chip8_rng_next(&soa->rng_state[l]) & NN;
+        }
+        break;
+
+    case 0xD: // draw N height sprite at (V[X], V[Y]), as draw_sprite in the core
+    {
+        uint64_t collision[CHIP8_SOA_LANES] = {0};
+        for (uint8_t i = 0; i < N; i++)
+        {
+            FOR_LANES
+            {
+                const uint8_t x_coord = VX[l] % DISPLAY_WIDTH;
+                const uint8_t y_coord = VY[l] % DISPLAY_HEIGHT;
+                if (!m[l] || y_coord + i >= DISPLAY_HEIGHT)
+                    continue;
+
+                const uint64_t sprite_data = soa->ram[(soa->I[l] + i) & 0xFFF][l];
+                const uint64_t sprite_row = x_coord <= 56 ? sprite_data << (56 - x_coord) : sprite_data >> (x_coord - 56);
+                collision[l] |= soa->display[y_coord + i][l] & sprite_row;
+                soa->display[y_coord + i][l] ^= sprite_row;
+            }
+        }
+        FOR_LANES VF[l] = m[l] ? collision[l] != 0 : VF[l];
+        break;
+    }
+
+    case 0xE:
+        if (NN == 0x9E) // skip if key stored in V[X] is pressed
+            FOR_LANES PC[l] += (m[l] && ((soa->keys[l] >> (VX[l] & 0xF)) & 1)) ? 2 : 0;
+        else if (NN == 0xA1) // skip if key stored in V[X] is NOT pressed
+            FOR_LANES PC[l] += (m[l] && !((soa->keys[l] >> (VX[l] & 0xF)) & 1)) ? 2 : 0;
+        break;
+
+    case 0xF:
+        switch (NN)
+        {
+        case 0x0A: // V[X] = get_key(); Await a key press
+            FOR_LANES
+            {
+                if (!m[l])
+                    continue;
+                if (soa->keys[l])
+                    VX[l] = (uint8_t)__builtin_ctz(soa->keys[l]);
+                else
+                    PC[l] -= 2; // stay here until a key is pressed
+            }
+            break;
+        case 0x07: FOR_LANES VX[l] = m[l] ? soa->delay_timer[l] : VX[l]; break;
+        case 0x15: FOR_LANES soa->delay_timer[l] = m[l] ? VX[l] : soa->delay_timer[l]; break;
+        case 0x18: FOR_LANES soa->sound_timer[l] = m[l] ? VX[l] : soa->sound_timer[l]; break;
+        case 0x1E: FOR_LANES soa->I[l] += m[l] ? VX[l] : 0; break;
+        case 0x29: FOR_LANES soa->I[l] = m[l] ? VX[l] * 5 : soa->I[l]; break;
+        case 0x33: // store BCD rep of V[X] from index I onwards
+            FOR_LANES
+            {
+                if (!m[l])
+                    continue;
+                uint8_t bcd = VX[l];
+                for (int i = 2; i >= 0; i--)
+                {
+                    soa->ram[(soa->I[l] + i) & 0xFFF][l] = bcd % 10;
+                    bcd /= 10;
+                }
+            }
+            break;
+        case 0x55: // store V[0] to V[X] in memory from index I onwards
+            for (uint8_t i = 0; i <= X; i++)
+            {
+                FOR_LANES
+                {
+                    if (m[l])
+                        soa->ram[(soa->I[l] + i) & 0xFFF][l] = soa->V[i][l];
+                }
+            }
+            break;
+        case 0x65: // load V[0] to V[X] from memory from index I onwards
+            for (uint8_t i = 0; i <= X; i++)
+            {
+                FOR_LANES
+                {
+                    if (m[l])
+                        soa->V[i][l] = soa->ram[(soa->I[l] + i) & 0xFFF][l];
+                }
+            }
+            break;
+        default:
+            break;
+        }
+        break;
+
+    default:
+        break; // unimplemented or invalid opcode
+    }
+}
+
+// one instruction on every lane, grouping lanes that share PC and opcode
+static void soa_step(chip8_soa_t *soa)
+{
+    uint8_t done[CHIP8_SOA_LANES];
+    uint8_t m[CHIP8_SOA_LANES];
+    for (uint32_t l = 0; l < CHIP8_SOA_LANES; l++)
+        done[l] = l >= soa->lanes;
+
+    for (uint32_t leader = 0; leader < soa->lanes; leader++)
+    {
+        if (done[leader])
+            continue;
+
+        const uint16_t pc = soa->PC[leader] & 0xFFF;
+        const uint8_t high = soa->ram[pc][leader];
+        const uint8_t low = soa->ram[(pc + 1) & 0xFFF][leader];
+
+        // lanes earlier than the leader are all done already
+        uint32_t count = 0;
+        uint32_t hi = leader;
+        for (uint32_t l = leader; l < CHIP8_SOA_LANES; l++)
+        {
+            m[l] = !done[l] && (soa->PC[l] & 0xFFF) == pc && soa->ram[pc][l] == high && soa->ram[(pc + 1) & 0xFFF][l] == low;
+            count += m[l];
+            hi = m[l] ? l : hi;
+        }
+
+        // a lone lane only touches its own index, a group runs masked from its
+        // leader to its last member
+        const uint32_t lo = leader;
+        if (count == 1)
+        {
+            soa->stats.scalar_issues++;
+            soa_execute(soa, m, lo, lo, (high << 8) | low);
+        }
+        else
+        {
+            soa->stats.vector_issues++;
+            soa_execute(soa, m, lo, hi, (high << 8) | low);
+        }
+        soa->stats.lane_insts += count;
+
+        for (uint32_t l = leader; l <= hi; l++)
+            done[l] |= m[l];
+    }
+}
+
+chip8_soa_t *chip8_soa_create(void)
+{
+    return (chip8_soa_t *)calloc(1, sizeof(chip8_soa_t));
+}
+
+void chip8_soa_destroy(chip8_soa_t *soa)
+{
+    free(soa);
+}
+
+// load the same rom into the first lanes lanes, through the scalar loader so
+// limits and the font are shared
+bool chip8_soa_load_rom(chip8_soa_t *soa, uint32_t lanes, const uint8_t *rom, size_t rom_size, const char *rom_name)
+{
+    if (lanes == 0 || lanes > CHIP8_SOA_LANES)
+        return false;
+
+    chip8_t *chip8 = chip8_create();
+    if (!chip8 || !chip8_load_rom(chip8, rom, rom_size, rom_name))
+    {
+        chip8_destroy(chip8);
+        return false;
+    }
+
+    // seeds survive the reset, as in the scalar loader
+    uint64_t rng_seed[CHIP8_SOA_LANES];
+    memcpy(rng_seed, soa->rng_seed, sizeof rng_seed);
+    memset(soa, 0, sizeof(chip8_soa_t));
+    soa->lanes = lanes;
+    for (uint32_t address = 0; address < sizeof chip8->ram; address++)
+        memset(soa->ram[address], chip8->ram[address], CHIP8_SOA_LANES);
+    for (uint32_t l = 0; l < CHIP8_SOA_LANES; l++)
+    {
+        soa->PC[l] = chip8->PC;
+        chip8_soa_seed(soa, l, rng_seed[l]);
+    }
+
+    chip8_destroy(chip8);
+    return true;
+}
+
+void chip8_soa_run(chip8_soa_t *soa, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        soa_step(soa);
+}
+
+void chip8_soa_tick_timers(chip8_soa_t *soa)
+{
+    for (uint32_t l = 0; l < CHIP8_SOA_LANES; l++)
+    {
+        soa->delay_timer[l] -= soa->delay_timer[l] > 0;
+        soa->sound_timer[l] -= soa->sound_timer[l] > 0;
+    }
+}
+
+void chip8_soa_set_key(chip8_soa_t *soa, uint32_t lane, uint8_t key, bool down)
+{
+    const uint16_t bit = (uint16_t)(1u << (key & 0xF));
+    soa->keys[lane] = down ? soa->keys[lane] | bit : soa->keys[lane] & ~bit;
+}
+
+void chip8_soa_seed(chip8_soa_t *soa, uint32_t lane, uint64_t seed)
+{
+    soa->rng_seed[lane] = seed;
+    soa->rng_state[lane] = chip8_rng_from_seed(seed);
+}
+
+// copy one lane out into a scalar instance for hashing or inspection
+void chip8_soa_read_lane(const chip8_soa_t *soa, uint32_t lane, chip8_t *chip8)
+{
+    for (uint32_t address = 0; address < sizeof chip8->ram; address++)
+        chip8->ram[address] = soa->ram[address][lane];
+    for (uint32_t row = 0; row < DISPLAY_HEIGHT; row++)
+        chip8->display[row] = soa->display[row][lane];
+    for (uint32_t i = 0; i < 12; i++)
+        chip8->stack[i] = soa->stack[i][lane];
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        chip8->V[i] = soa->V[i][lane];
+        chip8->keypad[i] = (soa->keys[lane] >> i) & 1;
+    }
+    chip8->stack_ptr = &chip8->stack[soa->sp[lane] % 12];
+    chip8->I = soa->I[lane];
+    chip8->PC = soa->PC[lane];
+    chip8->delay_timer = soa->delay_timer[lane];
+    chip8->sound_timer = soa->sound_timer[lane];
+    chip8->rng_seed = soa->rng_seed[lane];
+    chip8->rng_state = soa->rng_state[lane];
+    chip8->state = RUNNING;
+
+    // the scalar caches know nothing about this ram, drop them
+    memset(chip8->decoded, 0, sizeof chip8->decoded);
+    chip8->dirty_rows = ~0u;
+}
+
+const chip8_soa_stats_t *chip8_soa_stats(const chip8_soa_t *soa)
+{
+    return &soa->stats;
+}
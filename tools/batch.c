@@ -0,0 +1,541 @@
+// batch: run many independent instances of one rom across all cores
+//
+// Usage: batch <rom_name> <instances> <frames> [--threads N] [--script file]
+//              [--backend name] [--engine scalar|soa] [--ips N] [--no-idle-skip]
+//              [--seed N] [--out file]
+//
+// Every instance is its own chip8_t running unthrottled for the given number
+// of 60hz frames at --ips instructions a second, with keypad input taken
+// from the script. Instances are spread over a work-stealing thread pool:
+// each worker starts with an equal slice of the instance range and steals
+// half of another worker's remaining slice once its own runs dry, so uneven
+// per-instance cost still keeps every core busy.
+// One line per instance is written with the FNV-1a hashes of its final
+// framebuffer and ram, reproducible for a given seed:
+//
+//     <instance> <framebuffer hash> <ram hash>
+//
+// With --engine soa, work is handed out in blocks of CHIP8_SOA_LANES
+// instances run in lockstep by the structure-of-arrays engine instead, and
+// the share of SIMD lanes doing useful work is reported. The lockstep engine
+// does not skip idle loops.
+//
+// Script lines are "<instance|*> <frame> <key> <0|1>", setting hex keypad
+// key up or down at the start of a frame; '#' starts a comment.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "../chip8.h"
+
+#define ALL_INSTANCES UINT32_MAX
+
+typedef struct
+{
+    uint32_t instance; // ALL_INSTANCES for every instance
+    uint32_t frame;
+    uint8_t key;
+    bool down;
+} key_event_t;
+
+typedef struct
+{
+    uint64_t framebuffer_hash;
+    uint64_t ram_hash;
+} result_t;
+
+// remaining instances of one worker as [next, end) packed into one word, so
+// the owner taking from the front and thieves taking from the back race on a
+// single compare and swap
+typedef struct
+{
+    uint64_t range;
+    char pad[64 - sizeof(uint64_t)]; // keep each worker's range on its own cache line
+} work_range_t;
+
+typedef struct
+{
+    const uint8_t *rom;
+    size_t rom_size;
+    const char *rom_name;
+    core_config_t config;
+    uint32_t frames;
+    uint32_t insts_per_second; // frames run to a chip8_frame_clock_t at this rate
+    uint64_t seed; // instance i runs with seed + i
+    const key_event_t *events; // sorted by frame
+    size_t event_count;
+    result_t *results;
+    work_range_t *ranges;
+    uint32_t thread_count;
+    uint32_t instance_count;
+    uint32_t task_size; // instances per work item, 1 or CHIP8_SOA_LANES
+    bool failed;
+} batch_t;
+
+typedef struct
+{
+    batch_t *batch;
+    uint32_t id;
+    uint32_t instances_run;
+    uint64_t insts; // instructions run by all of its instances
+    chip8_soa_stats_t soa_stats;
+} worker_t;
+
+static uint64_t pack_range(uint32_t next, uint32_t end)
+{
+    return (uint64_t)end << 32 | next;
+}
+
+static uint64_t fnv1a(const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// run one instance for every frame and record its hashes
+static bool run_instance(const batch_t *batch, chip8_t *chip8, uint32_t instance, uint64_t *insts)
+{
+    chip8_seed(chip8, batch->seed + instance);
+    if (!chip8_load_rom(chip8, batch->rom, batch->rom_size, batch->rom_name))
+        return false;
+
+    chip8_frame_clock_t clock;
+    chip8_frame_clock_start(&clock, chip8, batch->insts_per_second);
+    size_t event = 0;
+    for (uint32_t frame = 0; frame < batch->frames; frame++)
+    {
+        for (; event < batch->event_count && batch->events[event].frame <= frame; event++)
+        {
+            const key_event_t *e = &batch->events[event];
+            if (e->instance == ALL_INSTANCES || e->instance == instance)
+                chip8_set_key(chip8, e->key, e->down);
+        }
+
+        *insts += chip8_run_frame(chip8, &batch->config, &clock);
+        chip8_tick_timers(chip8);
+    }
+
+    batch->results[instance].framebuffer_hash = fnv1a(chip8_framebuffer(chip8), DISPLAY_HEIGHT * sizeof(uint64_t));
+    batch->results[instance].ram_hash = fnv1a(chip8->ram, sizeof chip8->ram);
+    return true;
+}
+
+// run a block of instances in lockstep and record their hashes; the lanes
+// have no cycle counter, so the clock only sizes the frames, as it does for
+// a scalar instance without cycle costs
+static bool run_soa_block(const batch_t *batch, chip8_soa_t *soa, chip8_t *lane_state, uint32_t first, uint32_t lanes,
+                          uint64_t *insts, chip8_soa_stats_t *stats)
+{
+    for (uint32_t l = 0; l < lanes; l++)
+        chip8_soa_seed(soa, l, batch->seed + first + l);
+    if (!chip8_soa_load_rom(soa, lanes, batch->rom, batch->rom_size, batch->rom_name))
+        return false;
+
+    chip8_frame_clock_t clock;
+    chip8_frame_clock_start(&clock, lane_state, batch->insts_per_second);
+    size_t event = 0;
+    for (uint32_t frame = 0; frame < batch->frames; frame++)
+    {
+        for (; event < batch->event_count && batch->events[event].frame <= frame; event++)
+        {
+            const key_event_t *e = &batch->events[event];
+            for (uint32_t l = 0; l < lanes; l++)
+            {
+                if (e->instance == ALL_INSTANCES || e->instance == first + l)
+                    chip8_soa_set_key(soa, l, e->key, e->down);
+            }
+        }
+
+        const uint32_t frame_insts = chip8_frame_clock_advance(&clock);
+        chip8_soa_run(soa, frame_insts);
+        chip8_soa_tick_timers(soa);
+        *insts += (uint64_t)frame_insts * lanes;
+    }
+
+    for (uint32_t l = 0; l < lanes; l++)
+    {
+        chip8_soa_read_lane(soa, l, lane_state);
+        batch->results[first + l].framebuffer_hash = fnv1a(chip8_framebuffer(lane_state), DISPLAY_HEIGHT * sizeof(uint64_t));
+        batch->results[first + l].ram_hash = fnv1a(lane_state->ram, sizeof lane_state->ram);
+    }
+
+    const chip8_soa_stats_t *block_stats = chip8_soa_stats(soa);
+    stats->lane_insts += block_stats->lane_insts;
+    stats->vector_issues += block_stats->vector_issues;
+    stats->scalar_issues += block_stats->scalar_issues;
+    return true;
+}
+
+// take the next work item from the front of our own range
+static bool pop_own(work_range_t *own, uint32_t *task)
+{
+    uint64_t range = __atomic_load_n(&own->range, __ATOMIC_ACQUIRE);
+    for (;;)
+    {
+        const uint32_t next = (uint32_t)range;
+        const uint32_t end = (uint32_t)(range >> 32);
+        if (next >= end)
+            return false;
+
+        if (__atomic_compare_exchange_n(&own->range, &range, pack_range(next + 1, end), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *task = next;
+            return true;
+        }
+    }
+}
+
+// move the back half of the busiest other worker's range into our own
+static bool steal(batch_t *batch, uint32_t thief)
+{
+    for (;;)
+    {
+        uint32_t victim = thief;
+        uint32_t most = 0;
+        uint64_t victim_range = 0;
+        for (uint32_t i = 0; i < batch->thread_count; i++)
+        {
+            const uint64_t range = __atomic_load_n(&batch->ranges[i].range, __ATOMIC_ACQUIRE);
+            const uint32_t next = (uint32_t)range;
+            const uint32_t end = (uint32_t)(range >> 32);
+            if (i != thief && end > next && end - next > most)
+            {
+                victim = i;
+                most = end - next;
+                victim_range = range;
+            }
+        }
+        if (victim == thief)
+            return false; // nothing left anywhere
+
+        const uint32_t next = (uint32_t)victim_range;
+        const uint32_t end = (uint32_t)(victim_range >> 32);
+        const uint32_t split = end - (most + 1) / 2;
+        if (__atomic_compare_exchange_n(&batch->ranges[victim].range, &victim_range, pack_range(next, split), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            // our range is empty, so no thief will touch it while it is replaced
+            __atomic_store_n(&batch->ranges[thief].range, pack_range(split, end), __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    batch_t *batch = worker->batch;
+
+    // one instance buffer per worker, reset by every rom load
+    const bool soa_engine = batch->task_size > 1;
+    chip8_t *chip8 = chip8_create();
+    chip8_soa_t *soa = soa_engine ? chip8_soa_create() : NULL;
+    if (!chip8 || (soa_engine && !soa))
+    {
+        __atomic_store_n(&batch->failed, true, __ATOMIC_RELAXED);
+        chip8_destroy(chip8);
+        return NULL;
+    }
+
+    for (;;)
+    {
+        uint32_t task;
+        if (!pop_own(&batch->ranges[worker->id], &task))
+        {
+            if (!steal(batch, worker->id))
+                break;
+            continue;
+        }
+
+        const uint32_t first = task * batch->task_size;
+        const uint32_t left = batch->instance_count - first;
+        const uint32_t count = left < batch->task_size ? left : batch->task_size;
+        const bool ok = soa_engine ? run_soa_block(batch, soa, chip8, first, count, &worker->insts, &worker->soa_stats)
+                                   : run_instance(batch, chip8, first, &worker->insts);
+        if (!ok)
+            __atomic_store_n(&batch->failed, true, __ATOMIC_RELAXED);
+        worker->instances_run += count;
+    }
+
+    chip8_soa_destroy(soa);
+    chip8_destroy(chip8);
+    return NULL;
+}
+
+// read the input script into a frame ordered event list
+static bool load_script(const char *name, key_event_t **events, size_t *count)
+{
+    FILE *script = fopen(name, "r");
+    if (!script)
+    {
+        fprintf(stderr, "Script file '%s' is invalid or does not exist!\n", name);
+        return false;
+    }
+
+    size_t capacity = 0;
+    char line[256];
+    for (uint32_t line_number = 1; fgets(line, sizeof line, script); line_number++)
+    {
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        char instance[16];
+        unsigned frame, key, down;
+        const int fields = sscanf(line, "%15s %u %x %u", instance, &frame, &key, &down);
+        if (fields <= 0)
+            continue; // blank line
+        if (fields != 4 || key > 0xF || down > 1)
+        {
+            fprintf(stderr, "%s:%u: expected '<instance|*> <frame> <key> <0|1>'\n", name, line_number);
+            fclose(script);
+            return false;
+        }
+
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            key_event_t *grown = (key_event_t *)realloc(*events, capacity * sizeof(key_event_t));
+            if (!grown)
+            {
+                fclose(script);
+                return false;
+            }
+            *events = grown;
+        }
+
+        key_event_t *e = &(*events)[(*count)++];
+        e->instance = strcmp(instance, "*") == 0 ? ALL_INSTANCES : (uint32_t)strtoul(instance, NULL, 10);
+        e->frame = frame;
+        e->key = (uint8_t)key;
+        e->down = down != 0;
+    }
+    fclose(script);
+
+    // stable insertion sort: events of one frame keep their script order,
+    // and scripts are normally written in frame order already
+    for (size_t i = 1; i < *count; i++)
+    {
+        const key_event_t e = (*events)[i];
+        size_t j = i;
+        for (; j > 0 && (*events)[j - 1].frame > e.frame; j--)
+            (*events)[j] = (*events)[j - 1];
+        (*events)[j] = e;
+    }
+    return true;
+}
+
+static uint32_t cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t)count : 1;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s <rom_name> <instances> <frames> [--threads N] [--script file]\n"
+                        "       [--backend switch|table|cached|jit|aot] [--engine scalar|soa] [--ips N] [--no-idle-skip]\n"
+                        "       [--seed N] [--out file]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    batch_t batch = {0};
+    batch.rom_name = argv[1];
+    const uint32_t instance_count = (uint32_t)strtoul(argv[2], NULL, 10);
+    batch.instance_count = instance_count;
+    batch.task_size = 1;
+    batch.frames = (uint32_t)strtoul(argv[3], NULL, 10);
+    chip8_default_config(&batch.config);
+    batch.thread_count = cpu_count();
+    uint32_t insts_per_second = 700;
+    const char *script_name = NULL;
+    const char *out_name = NULL;
+
+    for (int i = 4; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            batch.thread_count = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc)
+            script_name = argv[++i];
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            batch.seed = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc)
+            insts_per_second = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            out_name = argv[++i];
+        else if (strcmp(argv[i], "--no-idle-skip") == 0)
+            batch.config.idle_skip = false;
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (strcmp(name, "soa") == 0)
+                batch.task_size = CHIP8_SOA_LANES;
+            else if (strcmp(name, "scalar") != 0)
+            {
+                fprintf(stderr, "Unknown engine '%s'\n", name);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc)
+        {
+            if (!chip8_backend_from_name(argv[++i], &batch.config.backend))
+            {
+                fprintf(stderr, "Unknown backend '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (instance_count == 0 || batch.thread_count == 0)
+    {
+        fprintf(stderr, "Need at least one instance and one thread\n");
+        return EXIT_FAILURE;
+    }
+    const uint32_t task_count = (instance_count + batch.task_size - 1) / batch.task_size;
+    if (batch.thread_count > task_count)
+        batch.thread_count = task_count;
+    batch.insts_per_second = insts_per_second;
+
+    // the rom is read once and shared read-only by every instance
+    static uint8_t rom[4096];
+    FILE *rom_file = fopen(batch.rom_name, "rb");
+    if (!rom_file)
+    {
+        fprintf(stderr, "Rom file '%s' is invalid or does not exist!\n", batch.rom_name);
+        return EXIT_FAILURE;
+    }
+    batch.rom_size = fread(rom, 1, sizeof rom, rom_file);
+    fclose(rom_file);
+    batch.rom = rom;
+
+    // check the rom fits once up front rather than in every worker
+    chip8_t *probe = chip8_create();
+    if (!probe || !chip8_load_rom(probe, batch.rom, batch.rom_size, batch.rom_name))
+        return EXIT_FAILURE;
+    if (batch.config.backend == BACKEND_AOT && !chip8_aot_matches_rom(probe))
+    {
+        fprintf(stderr, "Rom '%s' does not match the recompiled rom, using the interpreter\n", batch.rom_name);
+        batch.config.backend = BACKEND_CACHED;
+    }
+    chip8_destroy(probe);
+
+    key_event_t *events = NULL;
+    if (script_name && !load_script(script_name, &events, &batch.event_count))
+        return EXIT_FAILURE;
+    batch.events = events;
+
+    batch.results = (result_t *)calloc(instance_count, sizeof(result_t));
+    batch.ranges = (work_range_t *)calloc(batch.thread_count, sizeof(work_range_t));
+    worker_t *workers = (worker_t *)calloc(batch.thread_count, sizeof(worker_t));
+    pthread_t *threads = (pthread_t *)calloc(batch.thread_count, sizeof(pthread_t));
+    if (!batch.results || !batch.ranges || !workers || !threads)
+    {
+        fprintf(stderr, "Out of memory for %u instances\n", instance_count);
+        return EXIT_FAILURE;
+    }
+
+    // equal starting slices, stealing evens out the rest
+    for (uint32_t t = 0; t < batch.thread_count; t++)
+    {
+        const uint32_t first = (uint32_t)((uint64_t)task_count * t / batch.thread_count);
+        const uint32_t last = (uint32_t)((uint64_t)task_count * (t + 1) / batch.thread_count);
+        batch.ranges[t].range = pack_range(first, last);
+        workers[t].batch = &batch;
+        workers[t].id = t;
+    }
+
+    const uint64_t start_time = chip8_time_ns();
+    uint32_t started = 0;
+    for (; started < batch.thread_count; started++)
+    {
+        if (pthread_create(&threads[started], NULL, worker_main, &workers[started]) != 0)
+        {
+            fprintf(stderr, "Could not start worker thread %u\n", started);
+            batch.failed = true;
+            break;
+        }
+    }
+    for (uint32_t t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    const double seconds = (chip8_time_ns() - start_time) / 1e9;
+
+    if (batch.failed)
+        return EXIT_FAILURE;
+
+    FILE *out = out_name ? fopen(out_name, "w") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "Could not open '%s' for writing!\n", out_name);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < instance_count; i++)
+        fprintf(out, "%u %016llx %016llx\n", i, (unsigned long long)batch.results[i].framebuffer_hash,
+                (unsigned long long)batch.results[i].ram_hash);
+    if (out != stdout)
+        fclose(out);
+
+    // throughput summary, along with how evenly the pool shared the work
+    const double frames = (double)instance_count * batch.frames;
+    uint64_t insts = 0;
+    for (uint32_t t = 0; t < batch.thread_count; t++)
+        insts += workers[t].insts;
+    fprintf(stderr, "%u instances x %u frames on %u threads (%s): %.3f s, %.0f frames/s, %.1f MIPS\n",
+            instance_count, batch.frames, batch.thread_count, batch.task_size > 1 ? "soa" : chip8_backend_name(batch.config.backend), seconds,
+            frames / seconds, insts / seconds / 1e6);
+    uint32_t fewest = instance_count, most = 0;
+    for (uint32_t t = 0; t < batch.thread_count; t++)
+    {
+        fewest = workers[t].instances_run < fewest ? workers[t].instances_run : fewest;
+        most = workers[t].instances_run > most ? workers[t].instances_run : most;
+    }
+    fprintf(stderr, "instances per thread: %u to %u\n", fewest, most);
+
+    // lane utilisation: lane slots doing useful work per opcode pass
+    if (batch.task_size > 1)
+    {
+        chip8_soa_stats_t total = {0, 0, 0};
+        for (uint32_t t = 0; t < batch.thread_count; t++)
+        {
+            total.lane_insts += workers[t].soa_stats.lane_insts;
+            total.vector_issues += workers[t].soa_stats.vector_issues;
+            total.scalar_issues += workers[t].soa_stats.scalar_issues;
+        }
+        const uint64_t issues = total.vector_issues + total.scalar_issues;
+        if (issues > 0)
+            fprintf(stderr, "soa: %.1f lanes per opcode pass, %.1f%% lane utilisation, %.1f%% of passes scalar\n",
+                    (double)total.lane_insts / issues, 100.0 * total.lane_insts / (issues * (double)CHIP8_SOA_LANES),
+                    100.0 * total.scalar_issues / issues);
+    }
+
+    free(threads);
+    free(workers);
+    free(batch.ranges);
+    free(batch.results);
+    free(events);
+    return EXIT_SUCCESS;
+}
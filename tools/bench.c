@@ -0,0 +1,115 @@
+// bench: headless throughput benchmark of every backend over a list of roms
+//
+// Usage: bench <rom_name>...
+//
+// Links against libchip8 only, no window or audio. Each rom runs a fixed
+// number of instructions in 60hz frames on a frame clock at the default 700
+// instructions a second, as in the main loop, on every backend without idle
+// skipping; the last row is the default backend with it, reporting the share
+// of instructions fast-forwarded. A synthetic DXYN heavy rom is always run
+// first. A second table gives the
+// cost of a save state snapshot and restore taken every frame.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../chip8.h"
+
+int main(int argc, char **argv)
+{
+    const uint64_t total_insts = 20000000;
+    const uint32_t insts_per_second = 700; // default clock rate
+
+    core_config_t default_config;
+    chip8_default_config(&default_config);
+
+    // DXYN microbenchmark: every fourth instruction draws a 15 row sprite
+    const uint8_t draw_rom[] = {
+        0xA0, 0x00, // I = 0
+        0xD0, 0x1F, // draw 15 rows at (V[0], V[1])
+        0x70, 0x03, // V[0] += 3
+        0x71, 0x01, // V[1] += 1
+        0x12, 0x02, // jump to the draw
+    };
+
+    printf("%-24s %-8s %10s %8s\n", "rom", "backend", "MIPS", "idle");
+    for (int r = 0; r < argc; r++)
+    {
+        const char *rom_name = r == 0 ? "(dxyn)" : argv[r];
+
+        // one row per backend, then the idle skipping row
+        for (int b = 0; b <= BACKEND_COUNT; b++)
+        {
+            const bool idle_row = b == BACKEND_COUNT;
+            core_config_t config = default_config;
+            config.backend = idle_row ? default_config.backend : (backend_t)b;
+            config.idle_skip = idle_row;
+
+            chip8_t *chip8 = chip8_create();
+            if (!chip8 || !(r == 0 ? chip8_load_rom(chip8, draw_rom, sizeof draw_rom, rom_name) : chip8_load_rom_file(chip8, rom_name)))
+                return EXIT_FAILURE;
+
+            if (config.backend == BACKEND_AOT && !chip8_aot_matches_rom(chip8))
+            {
+                chip8_destroy(chip8);
+                continue; // not built with this rom recompiled
+            }
+            chip8_seed(chip8, 1);
+
+            chip8_frame_clock_t clock;
+            chip8_frame_clock_start(&clock, chip8, insts_per_second);
+            uint64_t done = 0;
+            const uint64_t start_time = chip8_time_ns();
+            while (done < total_insts)
+            {
+                done += chip8_run_frame(chip8, &config, &clock);
+                chip8_tick_timers(chip8);
+            }
+            const double seconds = (chip8_time_ns() - start_time) / 1e9;
+
+            printf("%-24s %-8s %10.2f %7.1f%%\n", rom_name, idle_row ? "idle" : chip8_backend_name(config.backend),
+                   done / seconds / 1e6, 100.0 * chip8->idle_skipped / done);
+            chip8_destroy(chip8);
+        }
+    }
+
+    // save state cost, one snapshot and one restore per emulated frame
+    printf("\n%-24s %-8s %10s %10s\n", "rom", "backend", "snap ns", "restore ns");
+    for (int r = 0; r < argc; r++)
+    {
+        const char *rom_name = r == 0 ? "(dxyn)" : argv[r];
+        const uint32_t frames = 100000;
+        static chip8_state_t state;
+
+        chip8_t *chip8 = chip8_create();
+        if (!chip8 || !(r == 0 ? chip8_load_rom(chip8, draw_rom, sizeof draw_rom, rom_name) : chip8_load_rom_file(chip8, rom_name)))
+            return EXIT_FAILURE;
+
+        chip8_frame_clock_t clock;
+        chip8_frame_clock_start(&clock, chip8, insts_per_second);
+        uint64_t snapshot_ns = 0, restore_ns = 0;
+        for (uint32_t frame = 0; frame < frames; frame++)
+        {
+            uint64_t start_time = chip8_time_ns();
+            chip8_snapshot(chip8, &state);
+            snapshot_ns += chip8_time_ns() - start_time;
+
+            chip8_run_frame(chip8, &default_config, &clock);
+            chip8_tick_timers(chip8);
+
+            start_time = chip8_time_ns();
+            chip8_restore(chip8, &state);
+            restore_ns += chip8_time_ns() - start_time;
+
+            chip8_run_frame(chip8, &default_config, &clock);
+            chip8_tick_timers(chip8);
+        }
+
+        printf("%-24s %-8s %10.0f %10.0f\n", rom_name, chip8_backend_name(default_config.backend),
+               (double)snapshot_ns / frames, (double)restore_ns / frames);
+        chip8_destroy(chip8);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,362 @@
+// ch8c: ahead-of-time chip8 to C recompiler
+//
+// Usage: ch8c <rom_name> <output.c>
+//
+// Follows every path reachable from 0x200 through jumps, calls, returns and
+// skips, splits the code into basic blocks and writes one C function per
+// block. The output is built into the core with -DAOT_ROM="<output.c>"
+// (see the aot target in the Makefile) and run with --backend aot. Computed
+// jumps (BNNN), returns into unexplored code and blocks whose bytes were
+// overwritten at run time fall back to the interpreter.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRY_POINT 0x200
+#define RAM_SIZE 4096
+
+typedef struct
+{
+    uint8_t ram[RAM_SIZE];
+    size_t rom_size;
+    bool reachable[RAM_SIZE]; // an instruction starts here
+    bool leader[RAM_SIZE];    // a basic block starts here
+    uint16_t block_bytes[RAM_SIZE];
+    uint16_t block_insts[RAM_SIZE];
+    uint16_t block_cycles[RAM_SIZE];
+} program_t;
+
+static uint16_t fetch(const program_t *prog, uint32_t pc)
+{
+    return (prog->ram[pc] << 8) | prog->ram[pc + 1];
+}
+
+// cycles an instruction costs with cycle costs on, as cycle_cost in core.c
+static uint32_t cycle_cost(uint16_t opcode)
+{
+    switch (opcode >> 12)
+    {
+    case 0x0:
+        return opcode == 0x00E0 ? 8 : opcode == 0x00EE ? 2 : 1;
+    case 0x2:
+        return 2;
+    case 0xD:
+        return 2 + (opcode & 0xF);
+    case 0xF:
+        if ((opcode & 0xFF) == 0x33)
+            return 3;
+        if ((opcode & 0xFF) == 0x55 || (opcode & 0xFF) == 0x65)
+            return 2 + ((opcode >> 8) & 0xF) / 2;
+        return 1;
+    default:
+        return 1;
+    }
+}
+
+// instruction can change control flow, so it closes its basic block
+static bool is_terminator(uint16_t opcode)
+{
+    const uint8_t NN = opcode & 0xFF;
+
+    switch (opcode >> 12)
+    {
+    case 0x0: return NN == 0xEE;
+    case 0x1:
+    case 0x2:
+    case 0x3:
+    case 0x4:
+    case 0xB: return true;
+    case 0x5:
+    case 0x9: return (opcode & 0xF) == 0;
+    case 0xE: return NN == 0x9E || NN == 0xA1;
+    case 0xF: return NN == 0x0A || NN == 0x33 || NN == 0x55; // stores may rewrite the code that follows
+    default: return false;
+    }
+}
+
+static void push(uint16_t *worklist, int *count, program_t *prog, uint32_t pc)
+{
+    if (pc >= RAM_SIZE - 1 || prog->reachable[pc])
+        return;
+    prog->reachable[pc] = true;
+    worklist[(*count)++] = (uint16_t)pc;
+}
+
+// successors past the end of ram are left to the interpreter, like push
+static void mark_leader(program_t *prog, uint32_t pc)
+{
+    if (pc < RAM_SIZE)
+        prog->leader[pc] = true;
+}
+
+// mark reachable instructions and block leaders starting from the entry point
+static void analyse(program_t *prog)
+{
+    static uint16_t worklist[RAM_SIZE];
+    int count = 0;
+
+    prog->leader[ENTRY_POINT] = true;
+    push(worklist, &count, prog, ENTRY_POINT);
+
+    while (count > 0)
+    {
+        const uint32_t pc = worklist[--count];
+        const uint16_t opcode = fetch(prog, pc);
+        const uint16_t NNN = opcode & 0x0FFF;
+        const uint8_t NN = opcode & 0xFF;
+
+        switch (opcode >> 12)
+        {
+        case 0x0:
+            if (NN != 0xEE)
+                push(worklist, &count, prog, pc + 2);
+            break; // return targets are the successors of 2NNN
+
+        case 0x1:
+            prog->leader[NNN] = true;
+            push(worklist, &count, prog, NNN);
+            break;
+
+        case 0x2:
+            prog->leader[NNN] = true;
+            mark_leader(prog, pc + 2);
+            push(worklist, &count, prog, NNN);
+            push(worklist, &count, prog, pc + 2);
+            break;
+
+        case 0xB:
+            break; // computed jump, left to the interpreter
+
+        default:
+            if (is_terminator(opcode))
+            {
+                // skips continue at pc + 2 or pc + 4, FX0A also repeats itself
+                mark_leader(prog, pc + 2);
+                push(worklist, &count, prog, pc + 2);
+                if ((opcode >> 12) != 0xF)
+                {
+                    mark_leader(prog, pc + 4);
+                    push(worklist, &count, prog, pc + 4);
+                }
+                else if (NN == 0x0A)
+                    prog->leader[pc] = true;
+            }
+            else
+                push(worklist, &count, prog, pc + 2);
+            break;
+        }
+    }
+}
+
+// handler call for opcodes that are not worth expanding inline
+static void emit_handler(FILE *out, const char *handler, uint16_t opcode)
+{
+    fprintf(out, "    { static const instruction_t inst = {0x%04X, 0x%03X, 0x%02X, 0x%X, 0x%X, 0x%X}; %s(chip8, &inst); }\n",
+            opcode, opcode & 0xFFF, opcode & 0xFF, opcode & 0xF, (opcode >> 8) & 0xF, (opcode >> 4) & 0xF, handler);
+}
+
+// write the C statements for one instruction at pc
+static void emit_instruction(FILE *out, uint16_t opcode, uint32_t pc)
+{
+    const uint16_t NNN = opcode & 0x0FFF;
+    const uint8_t NN = opcode & 0xFF;
+    const uint8_t N = opcode & 0xF;
+    const uint8_t X = (opcode >> 8) & 0xF;
+    const uint8_t Y = (opcode >> 4) & 0xF;
+    const uint32_t next = pc + 2;
+
+    fprintf(out, "    // 0x%03X: %04X\n", pc, opcode);
+
+    switch (opcode >> 12)
+    {
+    case 0x0:
+        if (NN == 0xE0)
+            emit_handler(out, "op_00E0", opcode);
+        else if (NN == 0xEE)
+            fprintf(out, "    chip8->PC = *--chip8->stack_ptr;\n");
+        break;
+    case 0x1:
+        fprintf(out, "    chip8->PC = 0x%03X;\n", NNN);
+        break;
+    case 0x2:
+        fprintf(out, "    *chip8->stack_ptr++ = 0x%03X;\n    chip8->PC = 0x%03X;\n", next, NNN);
+        break;
+    case 0x3:
+        fprintf(out, "    chip8->PC = V[0x%X] == 0x%02X ? 0x%03X : 0x%03X;\n", X, NN, next + 2, next);
+        break;
+    case 0x4:
+        fprintf(out, "    chip8->PC = V[0x%X] != 0x%02X ? 0x%03X : 0x%03X;\n", X, NN, next + 2, next);
+        break;
+    case 0x5:
+        if (N == 0)
+            fprintf(out, "    chip8->PC = V[0x%X] == V[0x%X] ? 0x%03X : 0x%03X;\n", X, Y, next + 2, next);
+        break;
+    case 0x6:
+        fprintf(out, "    V[0x%X] = 0x%02X;\n", X, NN);
+        break;
+    case 0x7:
+        fprintf(out, "    V[0x%X] += 0x%02X;\n", X, NN);
+        break;
+    case 0x8:
+        switch (N)
+        {
+        case 0x0: fprintf(out, "    V[0x%X] = V[0x%X];\n", X, Y); break;
+        case 0x1: fprintf(out, "    V[0x%X] |= V[0x%X];\n", X, Y); break;
+        case 0x2: fprintf(out, "    V[0x%X] &= V[0x%X];\n", X, Y); break;
+        case 0x3: fprintf(out, "    V[0x%X] ^= V[0x%X];\n", X, Y); break;
+        case 0x4:
+            fprintf(out, "    V[0xF] = (uint16_t)(V[0x%X] + V[0x%X]) > 255;\n    V[0x%X] += V[0x%X];\n", X, Y, X, Y);
+            break;
+        case 0x5:
+            fprintf(out, "    V[0xF] = V[0x%X] >= V[0x%X];\n    V[0x%X] -= V[0x%X];\n", X, Y, X, Y);
+            break;
+        case 0x6:
+            fprintf(out, "    V[0xF] = V[0x%X] & 0x01;\n    V[0x%X] >>= 1;\n", X, X);
+            break;
+        case 0x7:
+            fprintf(out, "    V[0xF] = V[0x%X] >= V[0x%X];\n    V[0x%X] = V[0x%X] - V[0x%X];\n", Y, X, X, Y, X);
+            break;
+        case 0xE:
+            fprintf(out, "    V[0xF] = (V[0x%X] & 0x80) >> 7;\n    V[0x%X] <<= 1;\n", X, X);
+            break;
+        default:
+            break;
+        }
+        break;
+    case 0x9:
+        if (N == 0)
+            fprintf(out, "    chip8->PC = V[0x%X] != V[0x%X] ? 0x%03X : 0x%03X;\n", X, Y, next + 2, next);
+        break;
+    case 0xA:
+        fprintf(out, "    chip8->I = 0x%03X;\n", NNN);
+        break;
+    case 0xB:
+        fprintf(out, "    chip8->PC = V[0x0] + 0x%03X;\n", NNN);
+        break;
+    case 0xC:
+        emit_handler(out, "op_CXNN", opcode);
+        break;
+    case 0xD:
+        emit_handler(out, "op_DXYN", opcode);
+        break;
+    case 0xE:
+        if (NN == 0x9E)
+            fprintf(out, "    chip8->PC = chip8->keypad[V[0x%X] & 0xF] ? 0x%03X : 0x%03X;\n", X, next + 2, next);
+        else if (NN == 0xA1)
+            fprintf(out, "    chip8->PC = !chip8->keypad[V[0x%X] & 0xF] ? 0x%03X : 0x%03X;\n", X, next + 2, next);
+        break;
+    case 0xF:
+        switch (NN)
+        {
+        case 0x07: fprintf(out, "    V[0x%X] = chip8->delay_timer;\n", X); break;
+        case 0x15: fprintf(out, "    chip8->delay_timer = V[0x%X];\n", X); break;
+        case 0x18: fprintf(out, "    chip8->sound_timer = V[0x%X];\n", X); break;
+        case 0x1E: fprintf(out, "    chip8->I += V[0x%X];\n", X); break;
+        case 0x29: fprintf(out, "    chip8->I = V[0x%X] * 5;\n", X); break;
+        case 0x0A:
+            fprintf(out, "    chip8->PC = 0x%03X;\n", next);
+            emit_handler(out, "op_FX0A", opcode);
+            break;
+        case 0x33:
+        case 0x55:
+            emit_handler(out, NN == 0x33 ? "op_FX33" : "op_FX55", opcode);
+            fprintf(out, "    chip8->PC = 0x%03X;\n", next);
+            break;
+        case 0x65:
+            emit_handler(out, "op_FX65", opcode);
+            break;
+        default:
+            break;
+        }
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <rom_name> <output.c>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static program_t prog;
+
+    FILE *rom = fopen(argv[1], "rb");
+    if (!rom)
+    {
+        fprintf(stderr, "Rom file '%s' is invalid or does not exist!\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    prog.rom_size = fread(&prog.ram[ENTRY_POINT], 1, RAM_SIZE - ENTRY_POINT, rom);
+    fclose(rom);
+
+    analyse(&prog);
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out)
+    {
+        fprintf(stderr, "Could not open '%s' for writing!\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out, "// generated by ch8c from %s, do not edit\n\n", argv[1]);
+
+    // rom image, checked against ram before the compiled blocks are used
+    fprintf(out, "static const uint8_t aot_rom_image[%zu] = {", prog.rom_size);
+    for (size_t i = 0; i < prog.rom_size; i++)
+        fprintf(out, "%s0x%02X,", i % 16 ? " " : "\n    ", prog.ram[ENTRY_POINT + i]);
+    fprintf(out, "\n};\n\n");
+
+    // one function per basic block
+    uint32_t block_count = 0;
+    for (uint32_t start = 0; start < RAM_SIZE - 1; start++)
+    {
+        if (!prog.reachable[start] || !prog.leader[start])
+            continue;
+
+        fprintf(out, "static void aot_block_%03X(chip8_t *chip8)\n{\n", start);
+        fprintf(out, "    uint8_t *V = chip8->V;\n    (void)V;\n");
+
+        uint32_t pc = start;
+        uint32_t insts = 0;
+        uint32_t cycles = 0;
+        bool terminated = false;
+        do
+        {
+            const uint16_t opcode = fetch(&prog, pc);
+            emit_instruction(out, opcode, pc);
+            terminated = is_terminator(opcode);
+            insts++;
+            cycles += cycle_cost(opcode);
+            pc += 2;
+        } while (!terminated && pc < RAM_SIZE - 1 && prog.reachable[pc] && !prog.leader[pc]);
+
+        if (!terminated)
+            fprintf(out, "    chip8->PC = 0x%03X;\n", pc);
+        fprintf(out, "}\n\n");
+
+        prog.block_bytes[start] = (uint16_t)(pc - start);
+        prog.block_insts[start] = (uint16_t)insts;
+        prog.block_cycles[start] = (uint16_t)cycles;
+        block_count++;
+    }
+
+    // start address, covered bytes, instruction count, cycle cost, function
+    fprintf(out, "static const aot_block_t aot_blocks[] = {\n");
+    for (uint32_t start = 0; start < RAM_SIZE - 1; start++)
+    {
+        if (prog.reachable[start] && prog.leader[start])
+            fprintf(out, "    {0x%03X, %u, %u, %u, aot_block_%03X},\n", start, prog.block_bytes[start], prog.block_insts[start],
+                    prog.block_cycles[start], start);
+    }
+    fprintf(out, "};\n");
+
+    fclose(out);
+    printf("%s: %u blocks written to %s\n", argv[1], block_count, argv[2]);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,332 @@
+// difftest: run backends in lockstep against a reference and find where they
+// first disagree
+//
+// Usage: difftest <rom_name>... [--reference name] [--backend name]...
+//                 [--movie file] [--insts N] [--chunk N] [--ips N] [--seed N]
+//
+// Links against libchip8 only. For every rom, each tested backend (all the
+// others by default, aot only when it was built from that rom) runs next to
+// the reference backend (switch by default) on its own instance. Both get
+// the same input, from the movie or else from a fixed pseudo-random key
+// pattern, run the same frames as the emulator at --ips (or the movie's rate
+// and cycle costs) in chunks of at most --chunk (default a whole frame, 1
+// compares every instruction), and are compared after every chunk and every
+// timer tick.
+// Idle skipping is off so every instruction really runs on the backend.
+//
+// On a mismatch both instances are put back to the last state that agreed
+// and the chunk is bisected to the first instruction after which they
+// differ; that instruction and a diff of registers, stack, ram and display
+// are printed, and the exit status is non-zero. The recompiler only runs a
+// block when the chunk has room for all of it, so it is compared per block.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../chip8.h"
+
+typedef struct
+{
+    const char *rom_name;
+    const chip8_movie_t *movie; // NULL for the key pattern
+    core_config_t reference;
+    core_config_t tested;
+    uint64_t insts;             // instructions to run, rounded up to whole frames
+    uint32_t chunk;             // 0 for whole frames
+    uint32_t insts_per_second;
+    uint64_t seed;
+} difftest_t;
+
+// everything that defines the machine; caches and the keypad are left out,
+// the keypad as both instances are always given the same keys
+static bool states_equal(const chip8_t *a, const chip8_t *b)
+{
+    return a->PC == b->PC && a->I == b->I && a->delay_timer == b->delay_timer && a->sound_timer == b->sound_timer &&
+           a->stack_ptr - a->stack == b->stack_ptr - b->stack && a->rng_state == b->rng_state &&
+           memcmp(a->V, b->V, sizeof a->V) == 0 && memcmp(a->stack, b->stack, sizeof a->stack) == 0 &&
+           memcmp(a->ram, b->ram, sizeof a->ram) == 0 && memcmp(a->display, b->display, sizeof a->display) == 0;
+}
+
+static void print_diff(const chip8_t *a, const chip8_t *b, const char *name_a, const char *name_b)
+{
+    printf("    %-12s %10s %10s\n", "", name_a, name_b);
+    if (a->PC != b->PC)
+        printf("    %-12s %10X %10X\n", "PC", a->PC, b->PC);
+    if (a->I != b->I)
+        printf("    %-12s %10X %10X\n", "I", a->I, b->I);
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        if (a->V[i] != b->V[i])
+            printf("    V[%X]         %10X %10X\n", i, a->V[i], b->V[i]);
+    }
+    if (a->delay_timer != b->delay_timer)
+        printf("    %-12s %10X %10X\n", "delay timer", a->delay_timer, b->delay_timer);
+    if (a->sound_timer != b->sound_timer)
+        printf("    %-12s %10X %10X\n", "sound timer", a->sound_timer, b->sound_timer);
+    if (a->rng_state != b->rng_state)
+        printf("    %-12s %10s %10s\n", "rng state", "", "differs");
+    if (a->stack_ptr - a->stack != b->stack_ptr - b->stack)
+        printf("    %-12s %10d %10d\n", "stack depth", (int)(a->stack_ptr - a->stack), (int)(b->stack_ptr - b->stack));
+    for (uint8_t i = 0; i < 12; i++)
+    {
+        if (a->stack[i] != b->stack[i])
+            printf("    stack[%2u]    %10X %10X\n", i, a->stack[i], b->stack[i]);
+    }
+
+    // ram and display can differ in many places, the first few are enough
+    uint32_t shown = 0;
+    for (uint32_t address = 0; address < sizeof a->ram; address++)
+    {
+        if (a->ram[address] != b->ram[address] && shown++ < 16)
+            printf("    ram[0x%03X]   %10X %10X\n", address, a->ram[address], b->ram[address]);
+    }
+    if (shown > 16)
+        printf("    ... %u ram bytes differ\n", shown);
+    for (uint32_t row = 0; row < DISPLAY_HEIGHT; row++)
+    {
+        if (a->display[row] != b->display[row])
+            printf("    display row %2u %016llX %016llX\n", row, (unsigned long long)a->display[row],
+                   (unsigned long long)b->display[row]);
+    }
+}
+
+// put both instances back to the agreeing state and find the fewest
+// instructions after which they differ; both are left at that point, and pc
+// is where the reference was before the last of them
+static uint32_t bisect(const difftest_t *test, chip8_t *reference, chip8_t *tested, const chip8_state_t *good, uint32_t count,
+                       uint16_t *pc)
+{
+    uint32_t low = 1, high = count;
+    while (low < high)
+    {
+        const uint32_t middle = low + (high - low) / 2;
+        chip8_restore(reference, good);
+        chip8_restore(tested, good);
+        chip8_run(reference, &test->reference, middle);
+        chip8_run(tested, &test->tested, middle);
+        if (states_equal(reference, tested))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    chip8_restore(reference, good);
+    chip8_run(reference, &test->reference, low - 1);
+    *pc = reference->PC;
+
+    chip8_restore(reference, good);
+    chip8_restore(tested, good);
+    chip8_run(reference, &test->reference, low);
+    chip8_run(tested, &test->tested, low);
+    return low;
+}
+
+// instructions in the reference's next frame: one per cycle, or with cycle
+// costs as many as it takes to the deadline, found by running the frame and
+// putting the reference back
+static uint32_t next_frame_insts(const difftest_t *test, chip8_t *reference, chip8_frame_clock_t *clock,
+                                 chip8_state_t *scratch)
+{
+    if (!test->reference.cycle_costs)
+        return chip8_frame_clock_advance(clock);
+
+    chip8_snapshot(reference, scratch);
+    const uint64_t insts = chip8_run_frame(reference, &test->reference, clock);
+    chip8_restore(reference, scratch);
+    return (uint32_t)insts;
+}
+
+// lockstep one backend against the reference; true if they never disagreed
+static bool run_test(const difftest_t *test)
+{
+    const char *reference_name = chip8_backend_name(test->reference.backend);
+    const char *tested_name = chip8_backend_name(test->tested.backend);
+    chip8_t *reference = chip8_create();
+    chip8_t *tested = chip8_create();
+    if (!reference || !tested || !chip8_load_rom_file(reference, test->rom_name) || !chip8_load_rom_file(tested, test->rom_name))
+        exit(EXIT_FAILURE);
+
+    chip8_movie_position_t reference_position, tested_position;
+    if (test->movie)
+    {
+        chip8_movie_start(test->movie, reference, &reference_position);
+        chip8_movie_start(test->movie, tested, &tested_position);
+    }
+    else
+    {
+        chip8_seed(reference, test->seed);
+        chip8_seed(tested, test->seed);
+    }
+
+    static chip8_state_t good;
+    chip8_frame_clock_t clock;
+    chip8_frame_clock_start(&clock, reference, test->insts_per_second);
+    uint64_t done = 0;
+    uint32_t keys = (uint32_t)test->seed | 1;
+    const uint64_t start_time = chip8_time_ns();
+    for (uint64_t frame = 0; done < test->insts; frame++)
+    {
+        if (test->movie)
+        {
+            // keep going with the last keys once the movie is over
+            chip8_movie_play_keys(test->movie, &reference_position, reference);
+            chip8_movie_play_keys(test->movie, &tested_position, tested);
+        }
+        else if (frame % 20 == 0)
+        {
+            // a key goes up or down every third of a second
+            keys = keys * 1103515245u + 12345u;
+            chip8_set_key(reference, (keys >> 16) & 0xF, (keys >> 20) & 1);
+            chip8_set_key(tested, (keys >> 16) & 0xF, (keys >> 20) & 1);
+        }
+
+        const uint32_t frame_insts = next_frame_insts(test, reference, &clock, &good);
+        if (test->movie)
+        {
+            reference_position.frames++;
+            tested_position.frames++;
+            reference_position.insts += frame_insts;
+            tested_position.insts += frame_insts;
+        }
+
+        for (uint32_t left = frame_insts; left > 0;)
+        {
+            const uint32_t count = test->chunk && left > test->chunk ? test->chunk : left;
+            chip8_snapshot(reference, &good);
+            chip8_run(reference, &test->reference, count);
+            chip8_run(tested, &test->tested, count);
+            if (!states_equal(reference, tested))
+            {
+                uint16_t pc;
+                const uint32_t at = bisect(test, reference, tested, &good, count, &pc);
+                printf("%-24s %-8s diverged from %s after instruction %llu (frame %llu) at PC 0x%03X (%02X%02X)\n",
+                       test->rom_name, tested_name, reference_name, (unsigned long long)(done + at), (unsigned long long)frame,
+                       pc, good.ram[pc & 0xFFF], good.ram[(pc + 1) & 0xFFF]);
+                print_diff(reference, tested, reference_name, tested_name);
+                chip8_destroy(reference);
+                chip8_destroy(tested);
+                return false;
+            }
+            left -= count;
+            done += count;
+        }
+
+        chip8_tick_timers(reference);
+        chip8_tick_timers(tested);
+    }
+    const double seconds = (chip8_time_ns() - start_time) / 1e9;
+
+    printf("%-24s %-8s matches %s over %llu instructions (%.1f MIPS each)\n", test->rom_name, tested_name,
+           reference_name, (unsigned long long)done, done / seconds / 1e6);
+    chip8_destroy(reference);
+    chip8_destroy(tested);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <rom_name>... [--reference name] [--backend name]...\n"
+                        "       [--movie file] [--insts N] [--chunk N] [--ips N] [--seed N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    difftest_t test;
+    memset(&test, 0, sizeof test);
+    test.reference.backend = BACKEND_SWITCH;
+    test.insts = 10000000;
+    test.chunk = 0; // a whole frame
+    test.seed = 1;
+    uint32_t insts_per_second = 700;
+    bool selected[BACKEND_COUNT] = {false};
+    bool any_selected = false;
+    const char *movie_name = NULL;
+    const char *rom_names[256];
+    int rom_count = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--insts") == 0 && i + 1 < argc)
+            test.insts = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc)
+            test.chunk = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc)
+            insts_per_second = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            test.seed = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--movie") == 0 && i + 1 < argc)
+            movie_name = argv[++i];
+        else if ((strcmp(argv[i], "--reference") == 0 || strcmp(argv[i], "--backend") == 0) && i + 1 < argc)
+        {
+            backend_t backend;
+            const bool is_reference = strcmp(argv[i], "--reference") == 0;
+            if (!chip8_backend_from_name(argv[++i], &backend))
+            {
+                fprintf(stderr, "Unknown backend '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            if (is_reference)
+                test.reference.backend = backend;
+            else
+                selected[backend] = any_selected = true;
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        else if (rom_count < (int)(sizeof rom_names / sizeof rom_names[0]))
+            rom_names[rom_count++] = argv[i];
+    }
+    if (rom_count == 0)
+    {
+        fprintf(stderr, "Need at least one rom\n");
+        return EXIT_FAILURE;
+    }
+
+    chip8_movie_t movie;
+    if (movie_name)
+    {
+        if (!chip8_load_movie_file(&movie, movie_name))
+            return EXIT_FAILURE;
+        test.movie = &movie;
+        insts_per_second = movie.insts_per_second;
+        test.reference.cycle_costs = test.tested.cycle_costs = movie.config.cycle_costs;
+    }
+    if (insts_per_second == 0)
+    {
+        fprintf(stderr, "Need a rate of at least one instruction per second\n");
+        return EXIT_FAILURE;
+    }
+    test.insts_per_second = insts_per_second;
+
+    bool all_matched = true;
+    for (int r = 0; r < rom_count; r++)
+    {
+        test.rom_name = rom_names[r];
+        for (int b = 0; b < BACKEND_COUNT; b++)
+        {
+            test.tested.backend = (backend_t)b;
+            if (test.tested.backend == test.reference.backend || (any_selected && !selected[b]))
+                continue;
+
+            // every backend but aot is always built in; aot only for its own rom
+            if (test.tested.backend == BACKEND_AOT)
+            {
+                chip8_t *chip8 = chip8_create();
+                const bool matches = chip8 && chip8_load_rom_file(chip8, test.rom_name) && chip8_aot_matches_rom(chip8);
+                chip8_destroy(chip8);
+                if (!matches)
+                    continue;
+            }
+
+            all_matched = run_test(&test) && all_matched;
+        }
+    }
+
+    if (movie_name)
+        chip8_movie_free(&movie);
+    return all_matched ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,95 @@
+// replay: play an input movie back headless and unthrottled
+//
+// Usage: replay <rom_name> <movie> [--backend name] [--loops N]
+//
+// Links against libchip8 only. The movie is played from its start state
+// with the rate, cycle costs and idle skip setting it was recorded with, on
+// its backend unless overridden, as fast as the host allows. All backends give
+// the same result, with or without idle skipping. Every framebuffer is
+// folded into a hash that must equal the recorded one, so a movie doubles as
+// a reproducible regression and performance workload: the exit status is
+// non-zero on a mismatch. The rom is loaded first only to name the instance
+// and check the aot backend, the movie carries the ram.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../chip8.h"
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <rom_name> <movie> [--backend switch|table|cached|jit|aot] [--loops N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    chip8_movie_t movie;
+    if (!chip8_load_movie_file(&movie, argv[2]))
+        return EXIT_FAILURE;
+
+    core_config_t config = movie.config;
+    uint32_t loops = 1;
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc)
+            loops = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc)
+        {
+            if (!chip8_backend_from_name(argv[++i], &config.backend))
+            {
+                fprintf(stderr, "Unknown backend '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    chip8_t *chip8 = chip8_create();
+    if (!chip8 || !chip8_load_rom_file(chip8, argv[1]))
+        return EXIT_FAILURE;
+
+    // recompiled blocks are only usable with the rom they came from
+    if (config.backend == BACKEND_AOT && !chip8_aot_matches_rom(chip8))
+    {
+        fprintf(stderr, "Rom '%s' does not match the recompiled rom, using the interpreter\n", argv[1]);
+        config.backend = BACKEND_CACHED;
+    }
+
+    chip8_movie_position_t position;
+    chip8_frame_clock_t clock;
+    bool matched = true;
+    const uint64_t start_time = chip8_time_ns();
+    for (uint32_t loop = 0; loop < loops; loop++)
+    {
+        chip8_movie_start(&movie, chip8, &position);
+        chip8_frame_clock_start(&clock, chip8, movie.insts_per_second);
+        while (chip8_movie_play_keys(&movie, &position, chip8))
+        {
+            const uint64_t insts = chip8_run_frame(chip8, &config, &clock);
+            chip8_tick_timers(chip8);
+            chip8_movie_end_frame(&position, chip8, insts);
+        }
+        matched = matched && position.frames == movie.end.frames && position.display_hash == movie.end.display_hash;
+    }
+    const double seconds = (chip8_time_ns() - start_time) / 1e9;
+
+    printf("%llu frames, %u key changes, %s: %.0f frames/s, %.2f MIPS, %.0fx real time\n",
+           (unsigned long long)movie.end.frames, movie.event_count, chip8_backend_name(config.backend),
+           loops * movie.end.frames / seconds, loops * movie.end.insts / seconds / 1e6,
+           loops * movie.end.frames / 60.0 / seconds);
+    if (!matched)
+        printf("framebuffers differ from the recording, %llu of %llu frames played\n",
+               (unsigned long long)position.frames, (unsigned long long)movie.end.frames);
+    else
+        printf("framebuffers match the recording\n");
+
+    chip8_movie_free(&movie);
+    chip8_destroy(chip8);
+    return matched ? EXIT_SUCCESS : EXIT_FAILURE;
+}
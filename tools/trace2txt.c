@@ -0,0 +1,306 @@
+// trace2txt: render a binary execution trace as text
+//
+// Usage: trace2txt <trace> [--changes]
+//
+// Reads a trace written by a DEBUG core (see chip8_trace_start) and prints
+// one line per instruction in the format the core used to print while it
+// ran. The registers the descriptions quote are rebuilt from the sync
+// records and the changes of every instruction. With --changes, the
+// registers and ram bytes each instruction changed follow its line.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../chip8.h"
+
+typedef struct
+{
+    uint16_t PC;
+    uint16_t opcode;
+    uint8_t change_count;
+    uint16_t targets[CHIP8_TRACE_MAX_CHANGES];
+    uint16_t values[CHIP8_TRACE_MAX_CHANGES];
+} record_t;
+
+// registers before the instruction being described
+typedef struct
+{
+    uint8_t V[16];
+    uint16_t I;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+} registers_t;
+
+// value of a change in the record, or fallback when it has none
+static uint16_t change_or(const record_t *record, uint16_t target, uint16_t fallback)
+{
+    for (uint8_t i = 0; i < record->change_count; i++)
+    {
+        if (record->targets[i] == target)
+            return record->values[i];
+    }
+    return fallback;
+}
+
+static void print_description(const record_t *record, const registers_t *regs)
+{
+    const uint16_t opcode = record->opcode;
+    const uint16_t NNN = opcode & 0x0FFF;
+    const uint8_t NN = opcode & 0x00FF;
+    const uint8_t N = opcode & 0x000F;
+    const uint8_t X = (opcode >> 8) & 0x0F;
+    const uint8_t Y = (opcode >> 4) & 0x0F;
+    const uint8_t *V = regs->V;
+
+    printf("Address: 0x%04X, Opcode: 0x%04X, Desc: ", record->PC, opcode);
+    switch ((opcode >> 12) & 0x0F)
+    {
+    case 0x00:
+        if (NN == 0xE0)
+            printf("Clear screen\n");
+        else if (NN == 0xEE)
+            printf("Return from subroutine to address 0x%04X\n", change_or(record, CHIP8_TRACE_PC, record->PC + 2));
+        else
+            printf("Unimplemented opcode\n");
+        break;
+
+    case 0x01:
+        printf("Jump to NNN (0x%03X)\n", NNN);
+        break;
+
+    case 0x02:
+        printf("Call subroutine at NNN (0x%03X)\n", NNN);
+        break;
+
+    case 0x03:
+        printf("Skip next instruction if V[%X] (0x%02X) == NN (0x%02X)\n", X, V[X], NN);
+        break;
+
+    case 0x04:
+        printf("Skip next instruction if V[%X] (0x%02X) != NN (0x%02X)\n", X, V[X], NN);
+        break;
+
+    case 0x05:
+        printf("Skip next instruction if V[%X] (0x%02X) = V[%X] (0x%02X)\n", X, V[X], Y, V[Y]);
+        break;
+
+    case 0x06:
+        printf("Set V[%X] to NN (0x%02X)\n", X, NN);
+        break;
+
+    case 0x07:
+        printf("Add NN (0x%02X) to V[%X]\n", NN, X);
+        break;
+
+    case 0x08:
+        switch (N)
+        {
+        case 0x0:
+            printf("set V[%X] = V[%X] (0x%02X)\n", X, Y, V[Y]);
+            break;
+        case 0x1:
+            printf("set V[%X] (0x%02X) |= V[%X] (0x%02X) Result: 0x%02X\n", X, V[X], Y, V[Y], V[X] | V[Y]);
+            break;
+        case 0x2:
+            printf("set V[%X] (0x%02X) &= V[%X] (0x%02X) Result: 0x%02X\n", X, V[X], Y, V[Y], V[X] & V[Y]);
+            break;
+        case 0x3:
+            printf("set V[%X] (0x%02X) ^= V[%X] (0x%02X) Result: 0x%02X\n", X, V[X], Y, V[Y], V[X] ^ V[Y]);
+            break;
+        case 0x4: // set V[F] to 1 if carry
+            printf("set V[%X] (0x%02X) += V[%X] (0x%02X) Result: 0x%02X\n", X, V[X], Y, V[Y], V[X] + V[Y]);
+            break;
+        case 0x5: // set V[F] to 1 if no borrow
+            printf("set V[%X] (0x%02X) -= V[%X] (0x%02X) Result: 0x%02X\n", X, V[X], Y, V[Y], V[X] - V[Y]);
+            break;
+        case 0x6: // stores the LSB of V[X] in V[F]
+            printf("set V[%X] (0x%02X) >>= 1 Result: 0x%02X\n", X, V[X], V[X] >> 1);
+            break;
+        case 0x7: // set V[X] = V[Y] - V[X]
+            printf("set V[%X] (0x%02X) = V[%X] (0x%02X) - V[%X] Result: 0x%02X\n", X, V[X], Y, V[Y], X, V[Y] - V[X]);
+            break;
+        case 0xE: // stores the MSB of V[X] in V[F]
+            printf("set V[%X] (0x%02X) <<= 1 Result: 0x%02X\n", X, V[X], V[X] << 1);
+            break;
+        default:
+            break;
+        }
+        break;
+
+    case 0x09:
+        printf("Skip next instruction if V[%X] (0x%02X) != V[%X] (0x%02X)\n", X, V[X], Y, V[Y]);
+        break;
+
+    case 0x0A:
+        printf("Set I to NNN (0x%03X)\n", NNN);
+        break;
+
+    case 0x0B:
+        printf("Set PC to V[0] (0x%02X) + NNN (0x%03X) Result: %04X\n", V[0x0], NNN, V[0x0] + NNN);
+        break;
+
+    case 0x0C:
+        printf("Set V[%X] to rand(0-255) & NN (%02X) Result: %02X\n", X, NN, change_or(record, CHIP8_TRACE_V + X, V[X]));
+        break;
+
+    case 0x0D:
+        printf("Draw %X height sprite at at coords (V[%X], V[%X])\n", N, X, Y);
+        break;
+
+    case 0x0E:
+        if (NN == 0x9E)
+            printf("Skip next instruction if key stored in V[%X] is pressed; Keypad Value: %d\n", X, change_or(record, CHIP8_TRACE_KEY, 0));
+        else if (NN == 0xA1)
+            printf("Skip next instruction if key stored in V[%X] is NOT pressed; Keypad Value: %d\n", X, change_or(record, CHIP8_TRACE_KEY, 0));
+        break;
+
+    case 0x0F:
+        switch (NN)
+        {
+        case 0x0A:
+            printf("Set V[%X] to the key pressed; Await a key press\n", X);
+            break;
+        case 0x1E:
+            printf("Set I (0x%04X) += V[%X] (0x%02X) Result: 0x%04X\n", regs->I, X, V[X], regs->I + V[X]);
+            break;
+        case 0x07:
+            printf("Set V[%X] = delay timer (0x%02X)\n", X, regs->delay_timer);
+            break;
+        case 0x15:
+            printf("set delay timer = V[%X] (0x%02X)\n", X, V[X]);
+            break;
+        case 0x18:
+            printf("set sound timer = V[%X] (0x%02X)\n", X, V[X]);
+            break;
+        case 0x29:
+            printf("Set I = location of sprite of character stored in V[%X] (0x%02X); Result(V[%X] * 5): 0x%02X\n", X, V[X], X, V[X] * 5);
+            break;
+        case 0x33:
+            printf("Store BCD representation of V[%X] (0x%02X) in memory from index I (0x%04X) onwards\n", X, V[X], regs->I);
+            break;
+        case 0x55:
+            printf("Store values of registers V[0] - V[%X] in memory from index I (0x%04X) onwards\n", X, regs->I);
+            break;
+        case 0x65:
+            printf("Load values of registers V[0] - V[%X] in memory from index I (0x%04X) onwards\n", X, regs->I);
+            break;
+        default:
+            break;
+        }
+        break;
+
+    default:
+        printf("Unimplemented opcode\n");
+        break; // unimplemented or invalid opcode
+    }
+}
+
+static void print_changes(const record_t *record)
+{
+    for (uint8_t i = 0; i < record->change_count; i++)
+    {
+        const uint16_t target = record->targets[i];
+        const uint16_t value = record->values[i];
+        if (target < 0x1000)
+            printf("    ram[0x%03X] = 0x%02X\n", target, value);
+        else if (target < CHIP8_TRACE_V + 16)
+            printf("    V[%X] = 0x%02X\n", target - CHIP8_TRACE_V, value);
+        else if (target == CHIP8_TRACE_I)
+            printf("    I = 0x%04X\n", value);
+        else if (target == CHIP8_TRACE_DELAY)
+            printf("    delay timer = 0x%02X\n", value);
+        else if (target == CHIP8_TRACE_SOUND)
+            printf("    sound timer = 0x%02X\n", value);
+        else if (target == CHIP8_TRACE_PC)
+            printf("    PC = 0x%04X\n", value);
+    }
+}
+
+// registers after the instruction: its changes applied
+static void apply_changes(const record_t *record, registers_t *regs)
+{
+    for (uint8_t i = 0; i < record->change_count; i++)
+    {
+        const uint16_t target = record->targets[i];
+        if (target >= CHIP8_TRACE_V && target < CHIP8_TRACE_V + 16)
+            regs->V[target - CHIP8_TRACE_V] = (uint8_t)record->values[i];
+        else if (target == CHIP8_TRACE_I)
+            regs->I = record->values[i];
+        else if (target == CHIP8_TRACE_DELAY)
+            regs->delay_timer = (uint8_t)record->values[i];
+        else if (target == CHIP8_TRACE_SOUND)
+            regs->sound_timer = (uint8_t)record->values[i];
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || (argc > 2 && strcmp(argv[2], "--changes") != 0))
+    {
+        fprintf(stderr, "Usage: %s <trace> [--changes]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const bool show_changes = argc > 2;
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Trace file '%s' is invalid or does not exist!\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    uint8_t header[6];
+    if (fread(header, 1, sizeof header, file) != sizeof header || memcmp(header, "C8TR", 4) != 0 ||
+        (header[4] | header[5] << 8) != CHIP8_TRACE_VERSION)
+    {
+        fprintf(stderr, "Trace file '%s' is not a version %d chip8 trace!\n", argv[1], CHIP8_TRACE_VERSION);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    registers_t regs = {0};
+    record_t record;
+    uint64_t instructions = 0;
+    int type;
+    while ((type = fgetc(file)) != EOF)
+    {
+        uint8_t bytes[CHIP8_TRACE_MAX_CHANGES * 4];
+        if (type == CHIP8_TRACE_SYNC)
+        {
+            if (fread(bytes, 1, 20, file) != 20)
+                break;
+            memcpy(regs.V, bytes, sizeof regs.V);
+            regs.I = bytes[16] | bytes[17] << 8;
+            regs.delay_timer = bytes[18];
+            regs.sound_timer = bytes[19];
+            continue;
+        }
+
+        if (type != CHIP8_TRACE_INSTRUCTION || fread(bytes, 1, 5, file) != 5 || bytes[4] > CHIP8_TRACE_MAX_CHANGES)
+        {
+            fprintf(stderr, "Trace file '%s' is damaged after %llu instructions\n", argv[1], (unsigned long long)instructions);
+            fclose(file);
+            return EXIT_FAILURE;
+        }
+        record.PC = bytes[0] | bytes[1] << 8;
+        record.opcode = bytes[2] | bytes[3] << 8;
+        record.change_count = bytes[4];
+        if (fread(bytes, 4, record.change_count, file) != record.change_count)
+            break;
+        for (uint8_t i = 0; i < record.change_count; i++)
+        {
+            record.targets[i] = bytes[4 * i] | bytes[4 * i + 1] << 8;
+            record.values[i] = bytes[4 * i + 2] | bytes[4 * i + 3] << 8;
+        }
+
+        print_description(&record, &regs);
+        if (show_changes)
+            print_changes(&record);
+        apply_changes(&record, &regs);
+        instructions++;
+    }
+
+    fclose(file);
+    return EXIT_SUCCESS;
+}